@@ -0,0 +1,814 @@
+/*
+ * APoV Project host tools
+ * Capture reader and compose kernels shared by the command line tools,
+ * ported from the pspgu navigators.
+ */
+
+#ifndef APOV_H
+#define APOV_H
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#include "files.h"
+
+#define TEXTURE_BLOCK_SIZE 256
+#define CLUT_COLOR_COUNT 256
+#define KERNEL static inline __attribute__((always_inline))
+
+enum {
+    FORMAT_RAW = 0,
+    FORMAT_CLUT,
+    FORMAT_1BCM,
+    FORMATS_COUNT
+};
+
+static const char* const FORMAT_NAMES[] = {"raw", "clut", "1bcm"};
+
+// Window geometries with a compose kernel built for them, 256x256 with one
+// or two blocks per row
+enum {
+    KERNEL_ANY = 0,
+    KERNEL_256X256,
+    KERNEL_512X256
+};
+
+// Same layout as the header written by the apov generator for 1bcm
+typedef struct Options {
+    u32 SPACE_BLOCK_SIZE;
+    u32 HORIZONTAL_POV_COUNT;
+    u32 VERTICAL_POV_COUNT;
+    u32 RAY_STEP;
+    u32 WIDTH_BLOCK_COUNT;
+    u32 DEPTH_BLOCK_COUNT;
+    u32 COLOR_MAP_SIZE;
+    u32 TRACE_EDGES;
+    // File layout, 0 in generator headers for the POV major default
+    u32 POV_BLOCK;
+    u32 DEPTH_BLOCK;
+    // Run length coded masks behind a frame index, see packMasks()
+    u32 MASK_RUNS;
+} Options;
+
+typedef struct Cached {
+    u32 mask, moff, midx;
+    float fa, fb, fc;
+    u32 hcka, hckb, vcka, vckb;
+    u32 hoa, hob, voa, vob;
+} Cached;
+
+typedef struct Capture {
+    u8 FORMAT;
+    float MAX_PROJECTION_DEPTH;
+    float PROJECTION_FACTOR;
+    u32 HEADER_SIZE;
+    u32 HORIZONTAL_POV_COUNT;
+    u32 VERTICAL_POV_COUNT;
+    u32 RAY_STEP;
+    u32 WIDTH_BLOCK_COUNT;
+    u32 DEPTH_BLOCK_COUNT;
+    u32 COLOR_MAP_SIZE;
+    u32 TRACE_EDGES;
+    // Frames stored as WIDTH_BLOCK_COUNT contiguous 256x256 tiles
+    u8 TILED;
+    // Frames stored by blocks of POV_BLOCK points of view x DEPTH_BLOCK
+    // depths, see getFrameIndex()
+    u32 POV_BLOCK;
+    u32 DEPTH_BLOCK;
+    // 1bcm masks run length coded, see readPackedFrame()
+    u8 MASK_RUNS;
+
+    u16 WIN_WIDTH;
+    u16 WIN_HEIGHT;
+    u32 WIN_PIXELS_COUNT;
+    u32 DEPTH_FRAME_COUNT;
+    u32 POV_COUNT;
+
+    // Bytes of one frame in the file, and of a whole point of view
+    u32 FRAME_BYTES_COUNT;
+    u64 SPACE_BYTES_COUNT;
+
+    // 1bcm only
+    u32 WIN_BYTES_COUNT;
+    u16 MAP_WIDTH;
+    u16 MAP_HEIGHT;
+    u16 MAP_WIDTH_SCALE;
+    u16 MAP_HEIGHT_SCALE;
+    u32 MAP_BYTES_COUNT;
+    // File offset of each frame in the layout order and of the end, when
+    // the masks are run length coded
+    u32* frameOffsets;
+    // Slot of each frame in the layout order and number of slots, when
+    // deduplicated
+    u32* frameSlots;
+    u32 slotsCount;
+    Cached* cached;
+
+    u32 clut[CLUT_COLOR_COUNT];
+    int fd;
+    // Files listed in shards.txt (see apov-transcode -S) and the end of each
+    // one in the offsets of the whole capture. Without the manifest the
+    // capture is the single data file.
+    u32 SHARDS_COUNT;
+    int* shardFds;
+    u64* shardEnds;
+} Capture;
+
+static inline u8 getKernelGeometry(const Capture* const c) {
+    if(c->WIN_HEIGHT == 256 && c->WIN_WIDTH == 256) {
+        return KERNEL_256X256;
+    }
+    return c->WIN_HEIGHT == 256 && c->WIN_WIDTH == 512 ? KERNEL_512X256 : KERNEL_ANY;
+}
+
+static inline double getSeconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static inline int getFormat(const char* const name) {
+    int i = FORMATS_COUNT;
+    while(i--) {
+        if(!strcmp(name, FORMAT_NAMES[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline const char* getDataName(const u8 format) {
+    return format == FORMAT_CLUT ? "clut-indexes.bin" : "atoms.apov";
+}
+
+// Shard names, see files.h
+static inline void getShardName(const u8 format, const u32 shard, char* const name, const u32 size) {
+    const char* const data = getDataName(format);
+    if(!shard) {
+        snprintf(name, size, "%s", data);
+        return;
+    }
+    const char* const extension = strrchr(data, '.');
+    snprintf(name, size, "%.*s-%u%s", (int)(extension - data), data, shard, extension);
+}
+
+static inline FILE* openIn(const char* const dir, const char* const name, const char* const mode) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return fopen(path, mode);
+}
+
+// Derives the frame geometry from the parsed options, as main() does in
+// the navigators
+static inline void setGeometry(Capture* const c) {
+    c->WIN_WIDTH = TEXTURE_BLOCK_SIZE * c->WIDTH_BLOCK_COUNT;
+    c->WIN_HEIGHT = TEXTURE_BLOCK_SIZE;
+    c->WIN_PIXELS_COUNT = c->WIN_WIDTH * c->WIN_HEIGHT;
+    c->DEPTH_FRAME_COUNT = (c->DEPTH_BLOCK_COUNT * TEXTURE_BLOCK_SIZE) / c->RAY_STEP;
+    c->POV_COUNT = c->HORIZONTAL_POV_COUNT * c->VERTICAL_POV_COUNT;
+    if(c->MAX_PROJECTION_DEPTH > 0.0f) {
+        c->PROJECTION_FACTOR = 1.0f / c->MAX_PROJECTION_DEPTH;
+    }
+
+    if(c->FORMAT == FORMAT_RAW) {
+        c->FRAME_BYTES_COUNT = c->WIN_PIXELS_COUNT * sizeof(u32);
+    } else if(c->FORMAT == FORMAT_CLUT) {
+        c->FRAME_BYTES_COUNT = c->WIN_PIXELS_COUNT * sizeof(u8);
+    } else {
+        c->WIN_BYTES_COUNT = c->WIN_PIXELS_COUNT / 8;
+        c->MAP_WIDTH = c->COLOR_MAP_SIZE * c->WIDTH_BLOCK_COUNT;
+        c->MAP_HEIGHT = c->COLOR_MAP_SIZE;
+        c->MAP_BYTES_COUNT = c->MAP_WIDTH * c->MAP_HEIGHT * sizeof(u32);
+        c->MAP_WIDTH_SCALE = c->WIN_WIDTH / c->MAP_WIDTH;
+        c->MAP_HEIGHT_SCALE = c->WIN_HEIGHT / c->MAP_HEIGHT;
+        c->FRAME_BYTES_COUNT = c->WIN_BYTES_COUNT + c->MAP_BYTES_COUNT;
+        c->HEADER_SIZE = HEADER_BYTES_COUNT;
+    }
+    c->SPACE_BYTES_COUNT = (u64)c->DEPTH_FRAME_COUNT * c->FRAME_BYTES_COUNT;
+
+    // Blocks must divide the capture, the default is one POV per block
+    if(!c->POV_BLOCK || c->POV_COUNT % c->POV_BLOCK) {
+        c->POV_BLOCK = 1;
+    }
+    if(!c->DEPTH_BLOCK || c->DEPTH_FRAME_COUNT % c->DEPTH_BLOCK) {
+        c->DEPTH_BLOCK = c->DEPTH_FRAME_COUNT;
+    }
+}
+
+// 1bcm per pixel lookups, see cache() in main-1bcm.c. Returns 0 on success.
+static inline int cache(Capture* const c) {
+    c->cached = malloc(c->WIN_PIXELS_COUNT * sizeof(Cached));
+    if(c->cached == NULL) {
+        return -1;
+    }
+    u16 x = 0;
+    while(x < c->WIN_WIDTH) {
+        u16 y = 0;
+        while(y < c->WIN_HEIGHT) {
+            Cached* const k = &c->cached[x + y * c->WIN_WIDTH];
+            const u32 i = x + y * c->WIN_WIDTH;
+            const float fx = ((float)x) / c->MAP_WIDTH_SCALE;
+            const float fy = ((float)y) / c->MAP_HEIGHT_SCALE;
+            const u32 ux = fx;
+            const u32 uy = fy;
+            const u32 uyb = uy * c->MAP_WIDTH;
+            const float hc = fx - ux - 0.5f;
+            const float vc = fy - uy - 0.5f;
+            k->mask = (0b1 << (i % 8));
+            k->moff = (i / 8);
+            k->midx = (ux + uyb);
+            k->fb = (hc < 0.0f ? -hc : hc);
+            k->fc = (vc < 0.0f ? -vc : vc);
+            k->fa = 1.0f - (k->fb + k->fc);
+            k->hoa = ux - 1 + uyb;
+            k->hob = ux + 1 + uyb;
+            k->voa = ux + uyb - c->MAP_WIDTH;
+            k->vob = ux + uyb + c->MAP_WIDTH;
+            k->hcka = hc < 0.0f && ux > 0 ? 1 : 0;
+            k->hckb = hc >= 0.0f && ux < (u32)(c->MAP_WIDTH - 1) ? 1 : 0;
+            k->vcka = vc < 0.0f && uy > 0 ? 1 : 0;
+            k->vckb = vc >= 0.0f && uy < (u32)(c->MAP_HEIGHT - 1) ? 1 : 0;
+            y++;
+        }
+        x++;
+    }
+    return 0;
+}
+
+// Reads options.txt (raw, clut) or the atoms.apov header (1bcm) and opens
+// the capture data. Returns 0 on success.
+static inline int openCapture(Capture* const c, const char* const dir, const u8 format) {
+    memset(c, 0, sizeof(Capture));
+    c->FORMAT = format;
+    c->RAY_STEP = 1;
+    c->WIDTH_BLOCK_COUNT = 1;
+    c->DEPTH_BLOCK_COUNT = 1;
+    c->HORIZONTAL_POV_COUNT = 4;
+    c->VERTICAL_POV_COUNT = 1;
+    c->fd = -1;
+
+    FILE* f;
+    if(format == FORMAT_1BCM) {
+        Options options;
+        if(!(f = openIn(dir, "atoms.apov", "rb"))) {
+            return -1;
+        }
+        const size_t n = fread(&options, sizeof(Options), 1, f);
+        fclose(f);
+        if(n != 1 || options.SPACE_BLOCK_SIZE != TEXTURE_BLOCK_SIZE) {
+            return -1;
+        }
+        c->HORIZONTAL_POV_COUNT = options.HORIZONTAL_POV_COUNT;
+        c->VERTICAL_POV_COUNT = options.VERTICAL_POV_COUNT;
+        c->RAY_STEP = options.RAY_STEP;
+        c->WIDTH_BLOCK_COUNT = options.WIDTH_BLOCK_COUNT;
+        c->DEPTH_BLOCK_COUNT = options.DEPTH_BLOCK_COUNT;
+        c->COLOR_MAP_SIZE = options.COLOR_MAP_SIZE;
+        c->TRACE_EDGES = options.TRACE_EDGES;
+        c->POV_BLOCK = options.POV_BLOCK;
+        c->DEPTH_BLOCK = options.DEPTH_BLOCK;
+        c->MASK_RUNS = options.MASK_RUNS;
+    } else if((f = openIn(dir, "options.txt", "r"))) {
+        char options[128] = {0};
+        if(fgets(options, sizeof(options), f)) {
+            if(format == FORMAT_RAW) {
+                sscanf(options, "MPDEPTH:%f HPOV:%u VPOV:%u RAYSTEP:%u WBCOUNT:%u DBCOUNT:%u HSIZE:%u",
+                    &c->MAX_PROJECTION_DEPTH,
+                    &c->HORIZONTAL_POV_COUNT,
+                    &c->VERTICAL_POV_COUNT,
+                    &c->RAY_STEP,
+                    &c->WIDTH_BLOCK_COUNT,
+                    &c->DEPTH_BLOCK_COUNT,
+                    &c->HEADER_SIZE);
+            } else {
+                sscanf(options, "HPOV:%u VPOV:%u RAYSTEP:%u WBCOUNT:%u DBCOUNT:%u",
+                    &c->HORIZONTAL_POV_COUNT,
+                    &c->VERTICAL_POV_COUNT,
+                    &c->RAY_STEP,
+                    &c->WIDTH_BLOCK_COUNT,
+                    &c->DEPTH_BLOCK_COUNT);
+            }
+            c->TILED = strstr(options, "TILED:1") != NULL;
+            const char* layout;
+            if((layout = strstr(options, "POVBLOCK:"))) {
+                sscanf(layout, "POVBLOCK:%u", &c->POV_BLOCK);
+            }
+            if((layout = strstr(options, "DEPTHBLOCK:"))) {
+                sscanf(layout, "DEPTHBLOCK:%u", &c->DEPTH_BLOCK);
+            }
+        }
+        fclose(f);
+    }
+
+    if(format == FORMAT_CLUT) {
+        if(!(f = openIn(dir, "clut.bin", "rb"))) {
+            return -1;
+        }
+        const size_t n = fread(c->clut, sizeof(u32), CLUT_COLOR_COUNT, f);
+        fclose(f);
+        if(n != CLUT_COLOR_COUNT) {
+            return -1;
+        }
+    }
+
+    if(!c->RAY_STEP || !c->WIDTH_BLOCK_COUNT || !c->DEPTH_BLOCK_COUNT ||
+        !c->HORIZONTAL_POV_COUNT || !c->VERTICAL_POV_COUNT) {
+        return -1;
+    }
+    setGeometry(c);
+    if(format == FORMAT_1BCM) {
+        if(!c->COLOR_MAP_SIZE || cache(c)) {
+            return -1;
+        }
+    }
+
+    c->shardFds = malloc(SHARDS_COUNT_MAX * sizeof(int));
+    c->shardEnds = malloc(SHARDS_COUNT_MAX * sizeof(u64));
+    if(c->shardFds == NULL || c->shardEnds == NULL) {
+        return -1;
+    }
+    char path[4096];
+    char name[64];
+    u64 end = 0;
+    if((f = openIn(dir, SHARDS_FILE, "r"))) {
+        char line[128];
+        while(c->SHARDS_COUNT < SHARDS_COUNT_MAX && fgets(line, sizeof(line), f)) {
+            unsigned long long first, last;
+            if(sscanf(line, "%63s %llu %llu", name, &first, &last) != 3 || first != end || last <= first) {
+                break;
+            }
+            snprintf(path, sizeof(path), "%s/%s", dir, name);
+            c->shardFds[c->SHARDS_COUNT] = open(path, O_RDONLY);
+            c->shardEnds[c->SHARDS_COUNT++] = end = last;
+            if(c->shardFds[c->SHARDS_COUNT - 1] < 0) {
+                fclose(f);
+                return -1;
+            }
+        }
+        fclose(f);
+    }
+    if(!c->SHARDS_COUNT) {
+        snprintf(path, sizeof(path), "%s/%s", dir, getDataName(format));
+        c->shardFds[0] = open(path, O_RDONLY);
+        c->shardEnds[0] = (u64)-1;
+        c->SHARDS_COUNT = 1;
+    }
+    c->fd = c->shardFds[0];
+    if(c->fd < 0) {
+        return -1;
+    }
+    if((f = openIn(dir, DEDUP_FILE, "rb"))) {
+        const u32 frames = c->POV_COUNT * c->DEPTH_FRAME_COUNT;
+        c->frameSlots = malloc(frames * sizeof(u32));
+        if(c->frameSlots == NULL) {
+            fclose(f);
+            return -1;
+        }
+        const size_t n = fread(&c->slotsCount, sizeof(u32), 1, f) + fread(c->frameSlots, sizeof(u32), frames, f);
+        fclose(f);
+        if(n != frames + 1 || c->MASK_RUNS) {
+            return -1;
+        }
+    }
+    if(c->MASK_RUNS) {
+        const u32 nbytes = (c->POV_COUNT * c->DEPTH_FRAME_COUNT + 1) * sizeof(u32);
+        c->frameOffsets = malloc(nbytes);
+        return c->frameOffsets != NULL &&
+            pread(c->fd, c->frameOffsets, nbytes, HEADER_BYTES_COUNT) == nbytes ? 0 : -1;
+    }
+    return 0;
+}
+
+static inline void closeCapture(Capture* const c) {
+    u32 i = 0;
+    while(i < c->SHARDS_COUNT) {
+        if(c->shardFds[i] >= 0) {
+            close(c->shardFds[i]);
+        }
+        i++;
+    }
+    c->SHARDS_COUNT = 0;
+    free(c->shardFds);
+    free(c->shardEnds);
+    free(c->cached);
+    free(c->frameOffsets);
+    free(c->frameSlots);
+    c->shardFds = NULL;
+    c->shardEnds = NULL;
+    c->cached = NULL;
+    c->frameOffsets = NULL;
+    c->frameSlots = NULL;
+}
+
+// Position of a frame in the file. Blocks of POV_BLOCK x DEPTH_BLOCK frames
+// follow each other depth block first, frames inside a block are POV major.
+// One POV per block is the POV major layout, one depth per block of all the
+// POVs is the depth major layout.
+static inline u64 getFrameIndex(const u32 povCount, const u32 depthCount, const u32 povBlock,
+    const u32 depthBlock, const u32 pov, const u32 move) {
+    const u64 block = (u64)(pov / povBlock) * (depthCount / depthBlock) + move / depthBlock;
+    return block * povBlock * depthBlock + (pov % povBlock) * depthBlock + move % depthBlock;
+}
+
+static inline u64 getCaptureIndex(const Capture* const c, const int move, const int hrotate, const int vrotate) {
+    return getFrameIndex(c->POV_COUNT, c->DEPTH_FRAME_COUNT, c->POV_BLOCK, c->DEPTH_BLOCK,
+        hrotate * c->VERTICAL_POV_COUNT + vrotate, move);
+}
+
+static inline u64 getOffset(const Capture* const c, const int move, const int hrotate, const int vrotate) {
+    const u64 index = getCaptureIndex(c, move, hrotate, vrotate);
+    if(c->frameSlots != NULL) {
+        const u32 slot = c->frameSlots[index];
+        return slot == DEDUP_EMPTY ? EMPTY_OFFSET : c->HEADER_SIZE + (u64)c->FRAME_BYTES_COUNT * slot;
+    }
+    return c->HEADER_SIZE + c->FRAME_BYTES_COUNT * index;
+}
+
+static inline int transfer(const int fd, u8* const data, const u32 nbytes, const u64 offset, const u8 write) {
+    u32 done = 0;
+    while(done < nbytes) {
+        const ssize_t n = write ?
+            pwrite(fd, data + done, nbytes - done, offset + done) :
+            pread(fd, data + done, nbytes - done, offset + done);
+        if(n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Transfers a row major frame, one row of each tile at a time when the
+// file is tiled
+static inline int transferFrame(const Capture* const c, const int fd, u8* const frame,
+    const u64 offset, const u8 write) {
+    if(!c->TILED || c->WIDTH_BLOCK_COUNT == 1 || c->FORMAT == FORMAT_1BCM) {
+        return transfer(fd, frame, c->FRAME_BYTES_COUNT, offset, write);
+    }
+    const u32 texel = c->FRAME_BYTES_COUNT / c->WIN_PIXELS_COUNT;
+    const u32 nbytes = TEXTURE_BLOCK_SIZE * texel;
+    u32 tile = 0;
+    while(tile < c->WIDTH_BLOCK_COUNT) {
+        u32 y = 0;
+        while(y < c->WIN_HEIGHT) {
+            u8* const row = &frame[(y * c->WIN_WIDTH + tile * TEXTURE_BLOCK_SIZE) * texel];
+            if(transfer(fd, row, nbytes, offset + ((u64)tile * c->WIN_HEIGHT + y) * nbytes, write)) {
+                return -1;
+            }
+            y++;
+        }
+        tile++;
+    }
+    return 0;
+}
+
+// Run length coded 1bcm masks. The runs alternate between empty and visible
+// voxels in the mask bit order, starting with an empty one, a run longer than
+// MASK_RUN_MAX is split by an empty run of the other kind. A packed frame is
+// the color map followed by the runs, or by the bitmask when the runs would
+// not be smaller.
+#define MASK_RUN_MAX 0xFFFF
+
+// Returns the number of runs, or max + 1 when there are more
+static inline u32 getMaskRuns(const u8* const bits, const u32 pixels, u16* const runs, const u32 max) {
+    u32 count = 0;
+    u32 i = 0;
+    u8 visible = 0;
+    while(i < pixels) {
+        u32 n = 0;
+        while(i < pixels && n < MASK_RUN_MAX && ((bits[i / 8] >> (i % 8)) & 1) == visible) {
+            n++;
+            i++;
+        }
+        if(count == max) {
+            return max + 1;
+        }
+        runs[count++] = n;
+        visible = !visible;
+    }
+    return count;
+}
+
+static inline void setMaskBits(u8* const bits, u32 first, const u32 last) {
+    while(first < last && first % 8) {
+        bits[first / 8] |= 1 << (first % 8);
+        first++;
+    }
+    const u32 bytes = (last - first) / 8;
+    memset(&bits[first / 8], 0xFF, bytes);
+    first += bytes * 8;
+    while(first < last) {
+        bits[first / 8] |= 1 << (first % 8);
+        first++;
+    }
+}
+
+static inline void putMaskRuns(const u16* const runs, const u32 count, u8* const bits, const u32 pixels) {
+    memset(bits, 0, pixels / 8);
+    u32 i = 0;
+    u32 r = 0;
+    while(r < count) {
+        i += runs[r++];
+        if(r < count) {
+            const u32 last = i + runs[r++];
+            setMaskBits(bits, i, last < pixels ? last : pixels);
+            i = last;
+        }
+    }
+}
+
+// Reads a packed frame back in the bitmask then color map layout
+static inline int readPackedFrame(const Capture* const c, u8* const frame, const u64 offset) {
+    const u64 index = (offset - c->HEADER_SIZE) / c->FRAME_BYTES_COUNT;
+    const u32 nbytes = c->frameOffsets[index + 1] - c->frameOffsets[index];
+    if(nbytes < c->MAP_BYTES_COUNT || nbytes > c->FRAME_BYTES_COUNT) {
+        return -1;
+    }
+    u8* const packed = malloc(nbytes);
+    const int err = transfer(c->fd, packed, nbytes, c->frameOffsets[index], 0);
+    if(!err) {
+        const u8* const mask = &packed[c->MAP_BYTES_COUNT];
+        memcpy(&frame[c->WIN_BYTES_COUNT], packed, c->MAP_BYTES_COUNT);
+        if(nbytes == c->FRAME_BYTES_COUNT) {
+            memcpy(frame, mask, c->WIN_BYTES_COUNT);
+        } else putMaskRuns((const u16*)mask, (nbytes - c->MAP_BYTES_COUNT) / sizeof(u16),
+            frame, c->WIN_PIXELS_COUNT);
+    }
+    free(packed);
+    return err;
+}
+
+// Returns the shard holding an offset of the whole capture and makes the
+// offset relative to it. Frames never cross two shards.
+static inline int getShard(const Capture* const c, u64* const offset) {
+    u32 i = 0;
+    while(i < c->SHARDS_COUNT - 1 && *offset >= c->shardEnds[i]) {
+        i++;
+    }
+    *offset -= i ? c->shardEnds[i - 1] : 0;
+    return c->shardFds[i];
+}
+
+static inline int readFrame(const Capture* const c, u8* const frame, const u64 offset) {
+    if(offset == EMPTY_OFFSET) {
+        memset(frame, 0, c->FRAME_BYTES_COUNT);
+        return 0;
+    }
+    if(c->frameOffsets != NULL) {
+        return readPackedFrame(c, frame, offset);
+    }
+    u64 local = offset;
+    const int fd = getShard(c, &local);
+    return transferFrame(c, fd, frame, local, 0);
+}
+
+// Occupancy sidecar read by the navigators, see files.h
+static inline u32 getOccupancyBytes(const Capture* const c) {
+    return OCCUPANCY_BOX_BYTES_COUNT +
+        (c->WIN_WIDTH / OCCUPANCY_CELL) * (c->WIN_HEIGHT / OCCUPANCY_CELL) / 8;
+}
+
+static inline void getOccupancy(const Capture* const c, const u32* const raw, u8* const record) {
+    const u16 columns = c->WIN_WIDTH / OCCUPANCY_CELL;
+    u16 box[4] = {c->WIN_WIDTH, c->WIN_HEIGHT, 0, 0};
+    memset(record, 0, getOccupancyBytes(c));
+    u32 y = 0;
+    while(y < c->WIN_HEIGHT) {
+        u32 x = 0;
+        while(x < c->WIN_WIDTH) {
+            if(raw[y * c->WIN_WIDTH + x]) {
+                const u32 bit = (y / OCCUPANCY_CELL) * columns + x / OCCUPANCY_CELL;
+                record[OCCUPANCY_BOX_BYTES_COUNT + bit / 8] |= 1 << (bit % 8);
+                box[0] = x < box[0] ? x : box[0];
+                box[1] = y < box[1] ? y : box[1];
+                box[2] = x + 1 > box[2] ? x + 1 : box[2];
+                box[3] = y + 1 > box[3] ? y + 1 : box[3];
+            }
+            x++;
+        }
+        y++;
+    }
+    if(!box[2]) {
+        box[0] = box[1] = 0;
+    }
+    memcpy(record, box, sizeof(box));
+}
+
+// Raw compose, see getView() in main.c. zpos is only used by the
+// projection pass. W and H are constants in the specialized kernels.
+KERNEL void rawViewWith(const Capture* const c, const u32* const frame, u8* const zpos,
+    u32* const base, const u8 dof, const int W, const int H) {
+    const int W_D2 = W / 2;
+    const int H_D2 = H / 2;
+
+    if(c->MAX_PROJECTION_DEPTH > 0.0f) {
+        memset(base, 0, c->WIN_PIXELS_COUNT * sizeof(u32));
+        memset(zpos, 0, c->WIN_PIXELS_COUNT);
+        u32 i = c->WIN_PIXELS_COUNT;
+        while(i--) {
+            const u32 _frame = frame[i];
+            const u8 depth = (u8)(_frame & 0x000000FF);
+            if(_frame) {
+                const float s = 1.0f - ((float)depth * c->PROJECTION_FACTOR);
+                const int _x = ((int)(i % W) - W_D2) * s;
+                const int _y = ((int)(i / W) - H_D2) * s;
+                if(_x >= -W_D2 && _x < W_D2 && _y >= -H_D2 && _y < H_D2) {
+                    const u16 __x = (_x + W_D2 - 2);
+                    const u16 __y = (_y + H_D2 - 2);
+                    const u32 offset = __x + __y * W;
+                    if(offset < c->WIN_PIXELS_COUNT) {
+                        u32* const px = &base[offset];
+                        if(!*px || (depth < zpos[offset])) {
+                            *px = 0xFF000000 | _frame;
+                            zpos[offset] = depth;
+                        }
+                    }
+                }
+            }
+        }
+    } else if(dof) {
+        memset(base, 0, c->WIN_PIXELS_COUNT * sizeof(u32));
+        const int size = 3;
+        u32 i = c->WIN_PIXELS_COUNT;
+        while(--i) {
+            const int x = i % W;
+            const int y = i / W;
+            const int xr = x + size >= W ? 0 : size;
+            const int xl = x - size < 0 ? 0 : -size;
+            const int yd = y + size >= H ? 0 : size;
+            const int yu = y - size < 0 ? 0 : -size;
+            u32 const o = frame[i];
+            u32 const a = frame[(x + xr - 1) + y * W];
+            u32 const b = frame[(x + xl + 1) + y * W];
+            u32 const c_ = frame[x + (y + yd - 1) * W];
+            u32 const d = frame[x + (y + yu + 1) * W];
+            u32 const e = frame[(x + xr) + (y + yd) * W];
+            u32 const f = frame[(x + xl) + (y + yd) * W];
+            u32 const g = frame[(x + xr) + (y + yu) * W];
+            u32 const h = frame[(x + xl) + (y + yu) * W];
+
+            if(o || a || b || c_ || d || e || f || g || h) {
+                const u8 n =
+                    (a ? 1 : 0) + (b ? 1 : 0) + (c_ ? 1 : 0) +
+                    (d ? 1 : 0) + (e ? 1 : 0) + (f ? 1 : 0) +
+                    (g ? 1 : 0) + (h ? 1 : 0);
+
+                const int dd = n ? ((
+                    (a >> 24) + (b >> 24) + (c_ >> 24) +
+                    (d >> 24) + (e >> 24) + (f >> 24) +
+                    (g >> 24) + (h >> 24)
+                ) / n) - (o >> 24) : 0;
+
+                if(dd >= -10 && dd <= 10) {
+                    const u8 _R = (
+                        (o & 0xFF) + (a & 0xFF) + (b & 0xFF) + (c_ & 0xFF) + (d & 0xFF) +
+                        (e & 0xFF) + (f & 0xFF) + (g & 0xFF) + (h & 0xFF)) / 9;
+                    const u8 _G = (
+                        ((o >> 8) & 0xFF) + ((a >> 8) & 0xFF) + ((b >> 8) & 0xFF) +
+                        ((c_ >> 8) & 0xFF) + ((d >> 8) & 0xFF) + ((e >> 8) & 0xFF) +
+                        ((f >> 8) & 0xFF) + ((g >> 8) & 0xFF) + ((h >> 8) & 0xFF)) / 9;
+                    const u8 _B = (
+                        ((o >> 16) & 0xFF) + ((a >> 16) & 0xFF) + ((b >> 16) & 0xFF) +
+                        ((c_ >> 16) & 0xFF) + ((d >> 16) & 0xFF) + ((e >> 16) & 0xFF) +
+                        ((f >> 16) & 0xFF) + ((g >> 16) & 0xFF) + ((h >> 16) & 0xFF)) / 9;
+
+                    const u8 od = o >> 24;
+                    const float m = od >= 127 ? 0.0f : (127.0f - od) / 127.0f;
+                    const u8 R = m * (o & 0xFF) + (1 - m) * _R;
+                    const u8 G = m * ((o >> 8) & 0xFF) + (1 - m) * _G;
+                    const u8 B = m * ((o >> 16) & 0xFF) + (1 - m) * _B;
+
+                    base[i] = 0xFF000000 | (B << 16) | (G << 8) | R;
+                } else base[i] = 0xFF000000 | o;
+            }
+        }
+    } else {
+        memcpy(base, frame, c->WIN_PIXELS_COUNT * sizeof(u32));
+    }
+}
+
+static inline void getRawViewAny(const Capture* const c, const u32* const frame, u8* const zpos,
+    u32* const base, const u8 dof) {
+    rawViewWith(c, frame, zpos, base, dof, c->WIN_WIDTH, c->WIN_HEIGHT);
+}
+
+static inline void getRawView(const Capture* const c, const u32* const frame, u8* const zpos,
+    u32* const base, const u8 dof) {
+    switch(getKernelGeometry(c)) {
+        case KERNEL_256X256: rawViewWith(c, frame, zpos, base, dof, 256, 256); break;
+        case KERNEL_512X256: rawViewWith(c, frame, zpos, base, dof, 512, 256); break;
+        default: getRawViewAny(c, frame, zpos, base, dof); break;
+    }
+}
+
+static inline void getClutView(const Capture* const c, const u8* const frame, u32* const base) {
+    u32 i = c->WIN_PIXELS_COUNT;
+    while(i--) {
+        base[i] = c->clut[frame[i]];
+    }
+}
+
+// 1bcm compose, see updateView() in main-1bcm.c
+KERNEL void view1bcmWith(const Capture* const c, const u8* const frame, u32* const base, const u8 mode,
+    const int W, const int H) {
+    const u32* const map = (const u32*)&frame[c->WIN_BYTES_COUNT];
+    const Cached* const cached = c->cached;
+    const int em[16] = {
+        -1, +1, -W, +W, -1-W, +1+W, -1+W, +1-W,
+        -2, +2, -2*W, +2*W, -2-2*W, +2+2*W, -2+2*W, +2-2*W
+    };
+    u32 i = 0;
+    if(mode == 0) {
+        while(i < c->WIN_PIXELS_COUNT) {
+            const Cached* const cache = &(cached[i]);
+            if(frame[cache->moff] & cache->mask) {
+                base[i] = map[cache->midx] | 0xFF << 24;
+            } else base[i] = 0x00;
+            i++;
+        }
+        return;
+    }
+    while(i < c->WIN_PIXELS_COUNT) {
+        const Cached* const cache = &(cached[i]);
+        if(frame[cache->moff] & cache->mask) {
+            u32 b, d;
+            const u32 a = map[cache->midx];
+            if(cache->hcka) {
+                b = map[cache->hoa];
+            } else if(cache->hckb) {
+                b = map[cache->hob];
+            } else b = 0;
+
+            if(cache->vcka) {
+                d = map[cache->voa];
+            } else if(cache->vckb) {
+                d = map[cache->vob];
+            } else d = 0;
+
+            const u8 R = (u8)(
+                ((a & 0xFF) * cache->fa) +
+                ((b & 0xFF) * cache->fb) +
+                ((d & 0xFF) * cache->fc));
+            const u8 G = (u8)(
+                (((a >> 8) & 0xFF) * cache->fa) +
+                (((b >> 8) & 0xFF) * cache->fb) +
+                (((d >> 8) & 0xFF) * cache->fc));
+            const u8 B = (u8)(
+                (((a >> 16) & 0xFF) * cache->fa) +
+                (((b >> 16) & 0xFF) * cache->fb) +
+                (((d >> 16) & 0xFF) * cache->fc));
+
+            base[i] = R | G << 8 | B << 16 | 0xFF << 24;
+        } else {
+            base[i] = 0x00;
+            if(c->TRACE_EDGES) {
+                const u16 x = i % W;
+                const u16 y = i / W;
+                if(x >= 2 && x < (W - 2) &&
+                   y >= 2 && y < (H - 2)) {
+                    u8 n = 0;
+                    while(n < 16) {
+                        const Cached* const ca = &(cached[i + em[n]]);
+                        const Cached* const cb = &(cached[i + em[n + 1]]);
+                        if((frame[ca->moff] & ca->mask) && (frame[cb->moff] & cb->mask)) {
+                            const u32 a = map[ca->midx];
+                            const u32 b = map[cb->midx];
+                            const u8 R = ((a & 0xFF) + (b & 0xFF)) / 2.5f;
+                            const u8 G = (((a >> 8) & 0xFF) + ((b >> 8) & 0xFF)) / 2.3f;
+                            const u8 B = (((a >> 16) & 0xFF) + ((b >> 16) & 0xFF)) / 2.3f;
+                            base[i] = R | G << 8 | B << 16 | 0xFF << 24;
+                            break;
+                        }
+                        n += 2;
+                    }
+                }
+            }
+        }
+        i++;
+    }
+}
+
+static inline void get1bcmViewAny(const Capture* const c, const u8* const frame, u32* const base, const u8 mode) {
+    view1bcmWith(c, frame, base, mode, c->WIN_WIDTH, c->WIN_HEIGHT);
+}
+
+static inline void get1bcmView(const Capture* const c, const u8* const frame, u32* const base, const u8 mode) {
+    switch(getKernelGeometry(c)) {
+        case KERNEL_256X256: view1bcmWith(c, frame, base, mode, 256, 256); break;
+        case KERNEL_512X256: view1bcmWith(c, frame, base, mode, 512, 256); break;
+        default: get1bcmViewAny(c, frame, base, mode); break;
+    }
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * APoV Project
+ * Single startup allocation holding the navigator buffers
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#define ARENA_BUFFERS_COUNT 32
+// Data cache line size, no two buffers share a line written back or DMAed
+#define ARENA_ALIGNMENT 64
+
+typedef struct Buffer {
+    const char* name;
+    void** ref;
+    u32 size;
+    u8 optional;
+    u8 dropped;
+} Buffer;
+
+static Buffer buffers[ARENA_BUFFERS_COUNT];
+static u8 bufferCount = 0;
+static u8* arena = NULL;
+static u32 arenaSize = 0;
+
+// Declares a buffer before the arena is placed. The pointer is set by
+// placeArena and stays NULL when an optional buffer does not fit. Nothing
+// can be declared once the arena is placed.
+static void planBuffer(const char* const name, void* const ref, const u32 size, const u8 optional) {
+    if(arena == NULL && bufferCount < ARENA_BUFFERS_COUNT) {
+        Buffer* const b = &buffers[bufferCount++];
+        b->name = name;
+        b->ref = (void**)ref;
+        b->size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+        b->optional = optional;
+        b->dropped = 0;
+        *b->ref = NULL;
+    }
+}
+
+static u32 getPlannedBytes() {
+    u32 total = 0;
+    u8 i = 0;
+    while(i < bufferCount) {
+        total += buffers[i].dropped ? 0 : buffers[i].size;
+        i++;
+    }
+    return total;
+}
+
+// Allocates the planned buffers at once. Optional buffers are dropped from
+// the last planned one until the arena fits in the heap, so they should be
+// planned from the most to the least useful. Returns 0 when the required
+// buffers alone do not fit.
+static u8 placeArena() {
+    u8 n = bufferCount;
+    while((arena = memalign(ARENA_ALIGNMENT, getPlannedBytes())) == NULL) {
+        while(n && (!buffers[n - 1].optional || buffers[n - 1].dropped)) {
+            n--;
+        }
+        if(!n) {
+            return 0;
+        }
+        buffers[--n].dropped = 1;
+    }
+    arenaSize = getPlannedBytes();
+
+    u32 offset = 0;
+    u8 i = 0;
+    while(i < bufferCount) {
+        if(!buffers[i].dropped) {
+            *buffers[i].ref = &arena[offset];
+            offset += buffers[i].size;
+        }
+        i++;
+    }
+    return 1;
+}
+
+static void freeArena() {
+    free(arena);
+    arena = NULL;
+}
+
+// Writes the byte budget of each buffer, dropped ones included
+static void writeBudget(const char* const path) {
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[64];
+    u8 i = 0;
+    while(i < bufferCount) {
+        const int n = snprintf(line, sizeof(line), "%s: %u bytes%s\n", buffers[i].name,
+            buffers[i].size, buffers[i].dropped ? " (dropped)" : "");
+        sceIoWrite(log, line, n);
+        i++;
+    }
+    const int n = snprintf(line, sizeof(line), "total: %u bytes\n", getPlannedBytes());
+    sceIoWrite(log, line, n);
+    sceIoClose(log);
+}
+
+// Places the arena or leaves with a message when the capture cannot fit
+static void requireArena(const char* const path) {
+    const u8 placed = placeArena();
+    writeBudget(path);
+    if(!placed) {
+        pspDebugScreenInit();
+        pspDebugScreenPrintf("Not enough memory: %u bytes needed, see %s\n",
+            getPlannedBytes(), path);
+        sceKernelDelayThread(5000000);
+        sceKernelExitGame();
+    }
+}
+
+#endif
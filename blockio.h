@@ -0,0 +1,164 @@
+/*
+ * APoV Project
+ * Capture reads through a sector aligned readahead window
+ */
+
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+// Memory stick sector size
+#define IO_ALIGNMENT 512
+#define IO_WINDOW_KB 64
+
+// Requests up to half the window are served from it. A miss loads the whole
+// window with one sector aligned transfer starting at the request, or ending
+// at it when the reads go backward, so the next frames, rows or tiles in the
+// direction of travel cost a copy. Larger requests, as raw and clut tiles,
+// are read directly between their first and last sector boundaries, the
+// partial sectors at both ends going through the window, so every transfer
+// is aligned and no byte is read twice. IOWINDOW:KB sets the window, 0 reads
+// every request directly as asked.
+static u32 IO_WINDOW = IO_WINDOW_KB * 1024;
+static u8* ioWindow = NULL;
+static SceUID ioFd = -1;
+static u64 ioStart = 0;
+static u32 ioLength = 0;
+static u64 ioLast = 0;
+
+static u64 ioRequests = 0;
+static u64 ioHits = 0;
+static u64 ioTransfers = 0;
+static u64 ioRequested = 0;
+static u64 ioTransferred = 0;
+static u64 ioTime = 0;
+
+static void getBlockSettings(const char* const options) {
+    const char* setting;
+    if((setting = strstr(options, "IOWINDOW:")) != NULL) {
+        u32 kb = IO_WINDOW_KB;
+        sscanf(setting, "IOWINDOW:%u", &kb);
+        IO_WINDOW = (kb * 1024) & ~(IO_ALIGNMENT - 1);
+        // Half the window and the sector before it must fit
+        IO_WINDOW = IO_WINDOW && IO_WINDOW < 2 * IO_ALIGNMENT ? 2 * IO_ALIGNMENT : IO_WINDOW;
+    }
+}
+
+// The window is left out on a full heap, every read is then direct
+static void planBlocks() {
+    if(IO_WINDOW) {
+        planBuffer("io window", &ioWindow, IO_WINDOW, 1);
+    }
+}
+
+// Forgets the window, after the file is reopened
+static void resetBlocks() {
+    ioFd = -1;
+    ioLength = 0;
+}
+
+// Zeroes the counts, after reads not made by the navigation
+static void clearBlocks() {
+    ioRequests = 0;
+    ioHits = 0;
+    ioTransfers = 0;
+    ioRequested = 0;
+    ioTransferred = 0;
+    ioTime = 0;
+}
+
+static int transferBlocks(const SceUID fd, void* const data, const u64 offset, const u32 nbytes) {
+    const u32 start = sceKernelGetSystemTimeLow();
+    sceIoLseek(fd, offset, SEEK_SET);
+    const int n = sceIoRead(fd, data, nbytes);
+    ioTime += sceKernelGetSystemTimeLow() - start;
+    ioTransfers++;
+    ioTransferred += n > 0 ? n : 0;
+    return n;
+}
+
+// Serves nbytes at offset from the window, loading length bytes from start
+// on a miss. Returns the bytes copied, short at the end of the file.
+static u32 copyWindow(const SceUID fd, u8* const data, const u64 offset, const u32 nbytes,
+    const u64 start, const u32 length) {
+    if(fd != ioFd || offset < ioStart || offset + nbytes > ioStart + ioLength) {
+        const int n = transferBlocks(fd, ioWindow, start, length);
+        ioFd = n > 0 ? fd : -1;
+        ioStart = start;
+        ioLength = n > 0 ? n : 0;
+    } else ioHits++;
+
+    const u64 end = ioStart + ioLength;
+    const u32 count = offset >= end ? 0 : (end - offset < nbytes ? end - offset : nbytes);
+    memcpy(data, &ioWindow[offset - ioStart], count);
+    return count;
+}
+
+static int readAligned(const SceUID fd, u8* const data, const u64 offset, const u32 nbytes) {
+    const u64 first = (offset + IO_ALIGNMENT - 1) & ~(u64)(IO_ALIGNMENT - 1);
+    const u64 last = (offset + nbytes) & ~(u64)(IO_ALIGNMENT - 1);
+    if(last <= first) {
+        return transferBlocks(fd, data, offset, nbytes);
+    }
+    u32 count = 0;
+    if(first > offset) {
+        count = copyWindow(fd, data, offset, first - offset, first - IO_ALIGNMENT, IO_ALIGNMENT);
+        if(count != first - offset) {
+            return count;
+        }
+    }
+    const int n = transferBlocks(fd, &data[count], first, last - first);
+    count += n > 0 ? n : 0;
+    if(n != last - first || offset + nbytes == last) {
+        return count;
+    }
+    return count + copyWindow(fd, &data[count], last, offset + nbytes - last, last, IO_ALIGNMENT);
+}
+
+// Reads nbytes at offset, returns the bytes read as sceIoRead
+static int readBlocks(const SceUID fd, void* const data, const u64 offset, const u32 nbytes) {
+    const u8 backward = offset < ioLast;
+    ioLast = offset;
+    ioRequests++;
+    ioRequested += nbytes;
+    if(ioWindow == NULL) {
+        return transferBlocks(fd, data, offset, nbytes);
+    }
+    if(nbytes > IO_WINDOW / 2) {
+        return readAligned(fd, data, offset, nbytes);
+    }
+
+    u64 start = offset & ~(u64)(IO_ALIGNMENT - 1);
+    if(backward) {
+        const u64 end = (offset + nbytes + IO_ALIGNMENT - 1) & ~(u64)(IO_ALIGNMENT - 1);
+        start = end > IO_WINDOW ? end - IO_WINDOW : 0;
+    }
+    return copyWindow(fd, data, offset, nbytes, start, IO_WINDOW);
+}
+
+// Requested bytes per second of transfer time, in 0.1 MB/s
+static u32 getBlocksRate() {
+    return ioTime ? (ioRequested * 10) / ioTime : 0;
+}
+
+static void printBlocks() {
+    hudPrintf("I/O: %u.%u MB/s, %llu reads, %llu transfers, %llu hits\n",
+        getBlocksRate() / 10, getBlocksRate() % 10, ioRequests, ioTransfers, ioHits);
+}
+
+// Writes the request and transfer counts of the run
+static void writeBlocks(const char* const path) {
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[160];
+    const int n = snprintf(line, sizeof(line),
+        "window: %u KB\nrequests: %llu, %llu bytes\ntransfers: %llu, %llu bytes\n"
+        "time: %llu us\neffective: %u.%u MB/s\n",
+        ioWindow != NULL ? IO_WINDOW / 1024 : 0, ioRequests, ioRequested,
+        ioTransfers, ioTransferred, ioTime, getBlocksRate() / 10, getBlocksRate() % 10);
+    sceIoWrite(log, line, n);
+    sceIoClose(log);
+}
+
+#endif
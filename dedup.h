@@ -0,0 +1,58 @@
+/*
+ * APoV Project
+ * Frame references written by apov-transcode -D
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "files.h"
+
+// The slots of dedup.bin, see files.h, map the frames to the data file. A
+// frame sharing the resident slot gets its offset, so its read and compose
+// are skipped as for the frame itself. The occupancy and reduced frames are
+// stored by slot.
+static u32* frameSlots = NULL;
+static SceUID dedupFd = -1;
+static u32 DEDUP_BYTES_COUNT = 0;
+
+// Opens the table matching the capture, returns the bytes to plan. stored
+// is set to the frames of the data file.
+static u32 openDedup(const u32 frames, u32* const stored) {
+    *stored = frames;
+    dedupFd = sceIoOpen(DEDUP_FILE, PSP_O_RDONLY, 0777);
+    if(dedupFd < 0) {
+        return 0;
+    }
+    DEDUP_BYTES_COUNT = frames * sizeof(u32);
+    u32 count = 0;
+    if(sceIoLseek(dedupFd, 0, SEEK_END) != DEDUP_BYTES_COUNT + sizeof(u32) ||
+        sceIoLseek(dedupFd, 0, SEEK_SET) || sceIoRead(dedupFd, &count, sizeof(u32)) != sizeof(u32)) {
+        sceIoClose(dedupFd);
+        dedupFd = -1;
+        return 0;
+    }
+    *stored = count;
+    return DEDUP_BYTES_COUNT;
+}
+
+static void loadDedup() {
+    if(dedupFd < 0) {
+        return;
+    }
+    if(frameSlots != NULL && DEDUP_BYTES_COUNT != sceIoRead(dedupFd, frameSlots, DEDUP_BYTES_COUNT)) {
+        frameSlots = NULL;
+    }
+    sceIoClose(dedupFd);
+}
+
+// Offset of a frame of the layout order, EMPTY_OFFSET when it is empty
+static u64 getSlotOffset(const u32 index, const u32 header, const u32 frameBytes) {
+    if(frameSlots == NULL) {
+        return header + (u64)frameBytes * index;
+    }
+    const u32 slot = frameSlots[index];
+    return slot == DEDUP_EMPTY ? EMPTY_OFFSET : header + (u64)frameBytes * slot;
+}
+
+#endif
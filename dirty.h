@@ -0,0 +1,91 @@
+/*
+ * APoV Project
+ * Per band change tracking, only the changed bands are composed again
+ */
+
+#ifndef DIRTY_H
+#define DIRTY_H
+
+// A band is DIRTY_ROWS rows of a texture tile (or of the window for 1bcm),
+// as high as an occupancy cell. The hash of its source is kept from the
+// composed frame, a different one marks it dirty. 0 is never a hash, it
+// forces the band to be composed again. DIRTY:1 enables the tracking.
+#define DIRTY_ROWS OCCUPANCY_CELL
+
+static u8 DIRTY = 0;
+static u32* bandHashes = NULL;
+static u8* dirtyBands = NULL;
+static u32 BANDS_COUNT = 0;
+static u64 dirtyCount = 0;
+static u64 bandsSeen = 0;
+
+// Plans the hashes and flags, the tracking is left out on a full heap
+static void planDirty(const u32 bands) {
+    if(DIRTY) {
+        BANDS_COUNT = bands;
+        planBuffer("band hashes", &bandHashes, bands * sizeof(u32), 1);
+        planBuffer("dirty bands", &dirtyBands, bands, 1);
+    }
+}
+
+static u8 isTracking() {
+    return bandHashes != NULL && dirtyBands != NULL;
+}
+
+// Flags every band dirty, after a change of the compose mode
+static void invalidateBands() {
+    if(isTracking()) {
+        memset(bandHashes, 0, BANDS_COUNT * sizeof(u32));
+    }
+}
+
+static u32 hashWords(const u32* const words, const u32 count, u32 hash) {
+    u32 i = 0;
+    while(i < count) {
+        hash = ((hash << 5) + hash) ^ words[i++];
+    }
+    return hash;
+}
+
+// Stores the new hash of a band, returns 1 when it changed
+static u8 updateBand(const u32 band, u32 hash) {
+    hash |= 1;
+    const u8 dirty = hash != bandHashes[band];
+    bandHashes[band] = hash;
+    dirtyBands[band] = dirty;
+    dirtyCount += dirty;
+    bandsSeen++;
+    return dirty;
+}
+
+static u8 isBandChanged(const u32 band) {
+    return !isTracking() || dirtyBands[band];
+}
+
+static u32 getDirtyPercent() {
+    return bandsSeen ? (dirtyCount * 100) / bandsSeen : 100;
+}
+
+static void printDirty() {
+    if(isTracking()) {
+        hudPrintf("Dirty: %u%%\n", getDirtyPercent());
+    }
+}
+
+// Writes the average dirty fraction of the run
+static void writeDirty(const char* const path) {
+    if(!isTracking()) {
+        return;
+    }
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[80];
+    const int n = snprintf(line, sizeof(line), "dirty: %llu of %llu bands (%u%%)\n",
+        dirtyCount, bandsSeen, getDirtyPercent());
+    sceIoWrite(log, line, n);
+    sceIoClose(log);
+}
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * APoV Project
+ * On-disk names and layouts shared by the navigators and the host tools
+ */
+
+#ifndef FILES_H
+#define FILES_H
+
+// 1bcm captures start with the options header
+#define HEADER_BYTES_COUNT 80
+
+// apov-transcode -S writes shards.txt with one "NAME START END FIRSTPOV
+// LASTPOV" line per file, START and END being its byte range in the single
+// file. The first shard keeps the data name, the others are numbered before
+// the extension: atoms.apov, atoms-1.apov...
+#define SHARDS_FILE "shards.txt"
+#define SHARDS_COUNT_MAX 64
+
+// apov-transcode -O writes occupancy.bin. A record holds the occupied
+// bounding box (x0, y0, x1, y1 as u16, ends excluded, all 0 when the frame
+// is empty) and one bit per 16x16 cell, row major. Records follow the data
+// file order.
+#define OCCUPANCY_FILE "occupancy.bin"
+#define OCCUPANCY_CELL 16
+#define OCCUPANCY_BOX_BYTES_COUNT 8
+
+// Deduplicated captures (see apov-transcode -D) only store each distinct
+// frame once, by slot in the data file. dedup.bin holds the number of slots,
+// then the slot of every frame in the layout order, DEDUP_EMPTY for the
+// empty frames which are not stored. The readers give them EMPTY_OFFSET.
+#define DEDUP_FILE "dedup.bin"
+#define DEDUP_EMPTY 0xFFFFFFFF
+#define EMPTY_OFFSET ((u64)-2)
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * APoV Project
+ * Frame statistics drawn by the GE from a font texture
+ */
+
+#ifndef HUD_H
+#define HUD_H
+
+#include <stdarg.h>
+
+#define HUD_GLYPH 8
+#define HUD_FIRST_CHAR 32
+#define HUD_CHARS_COUNT 96
+#define HUD_ATLAS_WIDTH 128
+#define HUD_ATLAS_HEIGHT 64
+#define HUD_TEXT_BYTES_COUNT 512
+#define HUD_GLYPHS_COUNT (HUD_TEXT_BYTES_COUNT * 2)
+#define HUD_COLOR 0xFF00A0FF
+
+// 8x8 font of pspDebugScreen, one byte per row, leftmost pixel first
+extern u8 msx[];
+
+// The lines of a frame are gathered by hudPrintf. They are drawn at the end
+// of its display list as one sprite per glyph, from a 4444 copy of the
+// pspDebugScreen font, with the vertices in their own buffer as the frame
+// list is small. HUD:0 prints them on the CPU with pspDebugScreen
+// once the list is done, as before. The overlay time of each frame is kept
+// to compare both ways.
+static u8 HUD = 1;
+static u16* hudAtlas = NULL;
+static char hudText[HUD_TEXT_BYTES_COUNT];
+static u32 hudLength = 0;
+static u32 hudFrameTime = 0;
+static u64 hudTime = 0;
+static u32 hudFrames = 0;
+
+typedef struct Glyph {
+    u16 u, v;
+    u16 x, y, z;
+} Glyph;
+static Glyph* hudGlyphs = NULL;
+
+// The atlas is left out on a full heap, the text is then printed on the CPU
+static void planHud() {
+    if(HUD) {
+        planBuffer("hud atlas", &hudAtlas, HUD_ATLAS_WIDTH * HUD_ATLAS_HEIGHT * sizeof(u16), 1);
+        planBuffer("hud glyphs", &hudGlyphs, HUD_GLYPHS_COUNT * sizeof(Glyph), 1);
+    }
+}
+
+static void buildHudAtlas() {
+    if(hudGlyphs == NULL) {
+        hudAtlas = NULL;
+    }
+    if(hudAtlas == NULL) {
+        return;
+    }
+    const u8 columns = HUD_ATLAS_WIDTH / HUD_GLYPH;
+    u8 c = 0;
+    while(c < HUD_CHARS_COUNT) {
+        const u8* const font = &msx[(HUD_FIRST_CHAR + c) * HUD_GLYPH];
+        u16* const glyph = &hudAtlas[(c / columns) * HUD_GLYPH * HUD_ATLAS_WIDTH + (c % columns) * HUD_GLYPH];
+        u8 y = 0;
+        while(y < HUD_GLYPH) {
+            u8 x = 0;
+            while(x < HUD_GLYPH) {
+                glyph[y * HUD_ATLAS_WIDTH + x] = (font[y] & (0x80 >> x)) ? 0xFFFF : 0x0000;
+                x++;
+            }
+            y++;
+        }
+        c++;
+    }
+    sceKernelDcacheWritebackRange(hudAtlas, HUD_ATLAS_WIDTH * HUD_ATLAS_HEIGHT * sizeof(u16));
+}
+
+static void hudPrintf(const char* const format, ...) {
+    const u32 start = sceKernelGetSystemTimeLow();
+    va_list args;
+    va_start(args, format);
+    const int n = vsnprintf(&hudText[hudLength], HUD_TEXT_BYTES_COUNT - hudLength, format, args);
+    va_end(args);
+    hudLength += n > 0 ? n : 0;
+    hudLength = hudLength < HUD_TEXT_BYTES_COUNT ? hudLength : HUD_TEXT_BYTES_COUNT - 1;
+    hudFrameTime += sceKernelGetSystemTimeLow() - start;
+}
+
+static void endHud(const u32 start) {
+    hudFrameTime += sceKernelGetSystemTimeLow() - start;
+    hudTime += hudFrameTime;
+    hudFrames++;
+    hudFrameTime = 0;
+    hudLength = 0;
+}
+
+// Appends the glyphs to the current display list, before sceGuFinish. The
+// texture state is left changed, the draw lists set theirs.
+static void drawHud() {
+    if(hudAtlas == NULL) {
+        return;
+    }
+    const u32 start = sceKernelGetSystemTimeLow();
+    const u8 columns = HUD_ATLAS_WIDTH / HUD_GLYPH;
+    Glyph* const glyphs = hudGlyphs;
+    u16 count = 0;
+    u16 x = 0;
+    u16 y = 0;
+    u32 i = 0;
+    while(i < hudLength && count + 2 <= HUD_GLYPHS_COUNT) {
+        const char ch = hudText[i++];
+        if(ch == '\n') {
+            x = 0;
+            y += HUD_GLYPH;
+            continue;
+        }
+        const u8 c = ch - HUD_FIRST_CHAR;
+        if(c && c < HUD_CHARS_COUNT) {
+            const u16 u = (c % columns) * HUD_GLYPH;
+            const u16 v = (c / columns) * HUD_GLYPH;
+            const Glyph a = {u, v, x, y, 0};
+            const Glyph b = {u + HUD_GLYPH, v + HUD_GLYPH, x + HUD_GLYPH, y + HUD_GLYPH, 0};
+            glyphs[count++] = a;
+            glyphs[count++] = b;
+        }
+        x += HUD_GLYPH;
+    }
+    sceKernelDcacheWritebackRange(glyphs, count * sizeof(Glyph));
+
+    sceGuEnable(GU_BLEND);
+    sceGuBlendFunc(GU_ADD, GU_SRC_ALPHA, GU_ONE_MINUS_SRC_ALPHA, 0, 0);
+    sceGuTexMode(GU_PSM_4444, 0, 0, 0);
+    sceGuTexImage(0, HUD_ATLAS_WIDTH, HUD_ATLAS_HEIGHT, HUD_ATLAS_WIDTH, hudAtlas);
+    sceGuTexFunc(GU_TFX_MODULATE, GU_TCC_RGBA);
+    sceGuTexFilter(GU_NEAREST, GU_NEAREST);
+    sceGuColor(HUD_COLOR);
+    sceGuDrawArray(GU_SPRITES, GU_TEXTURE_16BIT|GU_TRANSFORM_2D|GU_VERTEX_16BIT, count, 0, glyphs);
+    sceGuDisable(GU_BLEND);
+    endHud(start);
+}
+
+// Prints the lines on the CPU in the finished frame, without the atlas
+static void printHud(const int dbuff) {
+    if(hudAtlas != NULL) {
+        return;
+    }
+    const u32 start = sceKernelGetSystemTimeLow();
+    pspDebugScreenSetOffset(dbuff);
+    pspDebugScreenSetXY(0, 0);
+    pspDebugScreenSetTextColor(HUD_COLOR);
+    pspDebugScreenPrintf("%s", hudText);
+    endHud(start);
+}
+
+static u32 getHudUs() {
+    return hudFrames ? hudTime / hudFrames : 0;
+}
+
+// Writes the mean overlay time per frame of the run
+static void writeHud(const char* const path) {
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[80];
+    const int n = snprintf(line, sizeof(line), "hud: %s, %u frames, %u us per frame\n",
+        hudAtlas != NULL ? "ge" : "cpu", hudFrames, getHudUs());
+    sceIoWrite(log, line, n);
+    sceIoClose(log);
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * APoV Project
+ * Input to photon latency probe and late input latching
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#define LATENCY_SAMPLES_COUNT 128
+// Display refresh period and the margin kept before the vblank, in us
+#define VBLANK_PERIOD 16683
+#define LATCH_MARGIN 1000
+
+// In late mode the frame start is delayed so the pad is sampled as close
+// to the vblank as the measured frame work allows. START toggles the mode.
+static u8 LATE_LATCH = 0;
+
+typedef struct Latency {
+    u32 samples[LATENCY_SAMPLES_COUNT];
+    u32 count;
+    u32 p50, p99;
+} Latency;
+
+static Latency latencies[2];
+static u32 edgeTime = 0;
+static u8 edgeState = 0;
+static u8 edgeMode = 0;
+static u32 vblankTime = 0;
+static u32 latchTime = 0;
+static u32 workBudget = VBLANK_PERIOD;
+
+static void updatePercentiles(Latency* const l) {
+    u32 sorted[LATENCY_SAMPLES_COUNT];
+    const u32 count = l->count < LATENCY_SAMPLES_COUNT ? l->count : LATENCY_SAMPLES_COUNT;
+    u32 i = 0;
+    while(i < count) {
+        u32 j = i;
+        while(j && sorted[j - 1] > l->samples[i]) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = l->samples[i];
+        i++;
+    }
+    l->p50 = sorted[(count - 1) / 2];
+    l->p99 = sorted[((count - 1) * 99) / 100];
+}
+
+// Sleeps in late mode until the latest start leaving room for the frame work
+static void latencyWait() {
+    if(LATE_LATCH) {
+        const int delay = VBLANK_PERIOD - LATCH_MARGIN - workBudget -
+            (int)(sceKernelGetSystemTimeLow() - vblankTime);
+        if(delay > 0) {
+            sceKernelDelayThread(delay);
+        }
+    }
+}
+
+// Samples the pad, without waiting for a new sample in late mode. The first
+// new press is timestamped until its frame is displayed.
+static void latchPad(SceCtrlData* const pad) {
+    static u32 buttons = 0;
+    if(LATE_LATCH) {
+        sceCtrlPeekBufferPositive(pad, 1);
+    } else sceCtrlReadBufferPositive(pad, 1);
+    latchTime = sceKernelGetSystemTimeLow();
+
+    const u32 pressed = pad->Buttons & ~buttons;
+    buttons = pad->Buttons;
+    if(pressed & PSP_CTRL_START) {
+        LATE_LATCH = !LATE_LATCH;
+    } else if(pressed && !edgeState) {
+        edgeTime = pad->TimeStamp;
+        edgeMode = LATE_LATCH;
+        edgeState = 1;
+    }
+}
+
+// Called once the frame is composed, tracks the frame work in late mode
+static void latencyWorkDone() {
+    const u32 work = sceKernelGetSystemTimeLow() - latchTime;
+    workBudget = work > workBudget ? work : workBudget - (workBudget - work) / 16;
+}
+
+// Called when the vblank wait returns, the frame swapped after the previous
+// wait is the one displayed now
+static void latencyVblank() {
+    vblankTime = sceKernelGetSystemTimeLow();
+    if(edgeState == 2) {
+        Latency* const l = &latencies[edgeMode];
+        l->samples[l->count % LATENCY_SAMPLES_COUNT] = vblankTime - edgeTime;
+        l->count++;
+        updatePercentiles(l);
+        edgeState = 0;
+    }
+}
+
+static void latencySwap() {
+    edgeState = edgeState == 1 ? 2 : edgeState;
+}
+
+// Called instead of latencySwap when the press changed nothing on screen
+static void latencyIdle() {
+    edgeState = edgeState == 1 ? 0 : edgeState;
+}
+
+static void printLatency() {
+    const Latency* const l = &latencies[LATE_LATCH];
+    hudPrintf("Latency p50/p99: %u/%u ms (%s)\n", l->p50 / 1000, l->p99 / 1000,
+        LATE_LATCH ? "late" : "early");
+}
+
+// Writes the percentiles of both modes
+static void writeLatency(const char* const path) {
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[80];
+    u8 mode = 0;
+    while(mode < 2) {
+        const Latency* const l = &latencies[mode];
+        const int n = snprintf(line, sizeof(line), "%s: p50 %u us, p99 %u us (%u presses)\n",
+            mode ? "late" : "early", l->p50, l->p99, l->count);
+        sceIoWrite(log, line, n);
+        mode++;
+    }
+    sceIoClose(log);
+}
+
+#endif
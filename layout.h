@@ -0,0 +1,46 @@
+/*
+ * APoV Project
+ * Frame layout of the capture file, see apov-transcode -b
+ */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+// Frames are stored by blocks of POV_BLOCK points of view x DEPTH_BLOCK
+// depths, one block after the other depth block first, POV major inside a
+// block. One POV per block is the generator layout where stepping the depth
+// is sequential, one depth per block of all the POVs makes the rotations
+// sequential instead.
+static u32 POV_BLOCK = 1;
+static u32 DEPTH_BLOCK = 0;
+static u32 LAYOUT_POV_COUNT;
+static u32 LAYOUT_DEPTH_COUNT;
+
+static void getLayoutSettings(const char* const options) {
+    const char* setting;
+    if((setting = strstr(options, "POVBLOCK:")) != NULL) {
+        sscanf(setting, "POVBLOCK:%u", &POV_BLOCK);
+    }
+    if((setting = strstr(options, "DEPTHBLOCK:")) != NULL) {
+        sscanf(setting, "DEPTHBLOCK:%u", &DEPTH_BLOCK);
+    }
+}
+
+// Blocks not dividing the capture fall back to the generator layout
+static void setLayout(const u32 povCount, const u32 depthCount) {
+    LAYOUT_POV_COUNT = povCount;
+    LAYOUT_DEPTH_COUNT = depthCount;
+    if(!POV_BLOCK || povCount % POV_BLOCK) {
+        POV_BLOCK = 1;
+    }
+    if(!DEPTH_BLOCK || depthCount % DEPTH_BLOCK) {
+        DEPTH_BLOCK = depthCount;
+    }
+}
+
+static u32 getFrameIndex(const u32 pov, const u32 move) {
+    const u32 block = (pov / POV_BLOCK) * (LAYOUT_DEPTH_COUNT / DEPTH_BLOCK) + move / DEPTH_BLOCK;
+    return block * POV_BLOCK * DEPTH_BLOCK + (pov % POV_BLOCK) * DEPTH_BLOCK + move % DEPTH_BLOCK;
+}
+
+#endif
@@ -14,8 +14,22 @@
 #include <psprtc.h>
 #include <psppower.h>
 #include <pspdisplay.h>
+#include "profile.h"
+#include "arena.h"
+#include "hud.h"
+#include "latency.h"
+#include "replay.h"
+#include "occupancy.h"
+#include "layout.h"
+#include "dedup.h"
+#include "dirty.h"
+#include "tune.h"
+#include "blockio.h"
+#include "shards.h"
+#include "probe.h"
+#include "quality.h"
 
-#define HEADER_BYTES_COUNT 80
+#define KERNEL static inline __attribute__((always_inline))
 #define TEXTURE_BLOCK_SIZE 256
 #define BUFFER_WIDTH 512
 #define SCREEN_WIDTH 480
@@ -29,10 +43,13 @@ void sceDmacMemcpy(void *dst, const void *src, int size);
 
 typedef struct Cached {
     u32 mask, moff, midx;
+} Cached __attribute__((aligned(16)));
+
+typedef struct Smooth {
     float fa, fb, fc;
     u32 hcka, hckb, vcka, vckb;
     u32 hoa, hob, voa, vob;
-} Cached __attribute__((aligned(16)));
+} Smooth __attribute__((aligned(16)));
 
 typedef struct Vertex {
 	u16 u, v;
@@ -48,47 +65,106 @@ typedef struct Options {
     u32 DEPTH_BLOCK_COUNT;
     u32 COLOR_MAP_SIZE;
     u32 TRACE_EDGES;
+    u32 POV_BLOCK;
+    u32 DEPTH_BLOCK;
+    u32 MASK_RUNS;
 } Options;
 
 #define S TEXTURE_BLOCK_SIZE
 #define P (S / 16)
 #define T (S / 16)
     
+#define VISIBLE_TILES_COUNT 3
+    
 static u16 VERTICES_COUNT;
 static u16 TEXTURE_WIDTH;
 static Vertex* surface;
 static Options options;
 
+// Horizontal viewport over the texture tiles, panned with L/R
+static u16 VIEW_X = 0;
+static u8 FIRST_TILE;
+static u8 LAST_TILE;
+static u16 TILE_FIRST_VERTEX[VISIBLE_TILES_COUNT];
+static u16 TILE_VERTICES_COUNT[VISIBLE_TILES_COUNT];
+
+// The tiles are drawn by a call list, built again once the surface changes
+#define DRAW_LIST_BYTES_COUNT 256
+static u8* drawList;
+static u8 LIST_READY = 0;
+
+#define VERTICES_BY_BLOCK 2
+static u32 getSurfaceBytes() {
+    const u16 VIEW_WIDTH = TEXTURE_WIDTH < SCREEN_WIDTH ? TEXTURE_WIDTH : SCREEN_WIDTH;
+    return sizeof(Vertex) * VERTICES_BY_BLOCK * (TEXTURE_BLOCK_SIZE / P) * (VIEW_WIDTH / P);
+}
+
 void generateRenderSurface() {
-    const u8 VERTICES_BY_BLOCK = 2;
-    VERTICES_COUNT = VERTICES_BY_BLOCK * (TEXTURE_BLOCK_SIZE / P) * (TEXTURE_WIDTH / P);
-    surface = memalign(16, sizeof(Vertex) * VERTICES_COUNT);
-    const u16 X = (SCREEN_WIDTH - TEXTURE_WIDTH) / 2;
+    const u16 VIEW_WIDTH = TEXTURE_WIDTH < SCREEN_WIDTH ? TEXTURE_WIDTH : SCREEN_WIDTH;
+    const u16 X = (SCREEN_WIDTH - VIEW_WIDTH) / 2;
     const u16 Y = (SCREEN_HEIGHT - TEXTURE_BLOCK_SIZE) / 2;
-    u16 x = 0;
+    FIRST_TILE = VIEW_X / TEXTURE_BLOCK_SIZE;
+    LAST_TILE = (VIEW_X + VIEW_WIDTH - 1) / TEXTURE_BLOCK_SIZE;
+    u16 x = VIEW_X;
     u16 offset = 0;
-    while(x < TEXTURE_WIDTH) {
+    while(x < VIEW_X + VIEW_WIDTH) {
+        const u8 slot = x / TEXTURE_BLOCK_SIZE - FIRST_TILE;
+        const u16 u = x % TEXTURE_BLOCK_SIZE;
+        const u16 sx = X + x - VIEW_X;
+        if(x == VIEW_X || !u) {
+            TILE_FIRST_VERTEX[slot] = offset;
+        }
         u16 y = 0;
         while(y < TEXTURE_BLOCK_SIZE) {
-            const Vertex a = {x,   y,   X+x,   Y+y,   0};
-            const Vertex b = {x+T, y+T, X+x+P, Y+y+P, 0};
+            const Vertex a = {u,   y,   sx,   Y+y,   0};
+            const Vertex b = {u+T, y+T, sx+P, Y+y+P, 0};
             surface[offset + 0] = a;
             surface[offset + 1] = b;
             offset += VERTICES_BY_BLOCK;
             y += P;
         }
+        TILE_VERTICES_COUNT[slot] = offset - TILE_FIRST_VERTEX[slot];
         x += P;
     }
+    VERTICES_COUNT = offset;
+    sceKernelDcacheWritebackRange(surface, sizeof(Vertex) * VERTICES_COUNT);
+    LIST_READY = 0;
+}
+
+// Records the texture and draw commands of the visible tiles, the 1bcm base
+// stays row major so each tile is drawn with the window width as texture
+// buffer width
+static void buildDrawList(u32* const base) {
+    sceKernelDcacheWritebackInvalidateRange(drawList, DRAW_LIST_BYTES_COUNT);
+    sceGuStart(GU_CALL, drawList);
+    sceGuTexMode(GU_PSM_8888, 0, 1, 0);
+    sceGuTexFunc(GU_TFX_REPLACE, GU_TCC_RGB);
+    sceGuTexFilter(GU_NEAREST, GU_NEAREST);
+    u8 tile = FIRST_TILE;
+    while(tile <= LAST_TILE) {
+        const u8 slot = tile - FIRST_TILE;
+        sceGuTexImage(0, TEXTURE_BLOCK_SIZE, TEXTURE_BLOCK_SIZE, TEXTURE_WIDTH,
+            &base[tile * TEXTURE_BLOCK_SIZE]);
+        sceGuDrawArray(GU_SPRITES, GU_TEXTURE_16BIT|GU_TRANSFORM_2D|GU_VERTEX_16BIT,
+        TILE_VERTICES_COUNT[slot], 0, &surface[TILE_FIRST_VERTEX[slot]]);
+        tile++;
+    }
+    sceGuFinish();
+    LIST_READY = 1;
 }
 
 static u8 MODE = 0;
+static u8 MODE_SELECTED = 0;
+#define DROP_EDGES 0
+#define DROP_SMOOTHING 1
+static u8 TRACE_EDGES = 0;
+static u8 ON_CHANGE = 0;
 
 static u16 WIN_WIDTH;
 static u16 WIN_HEIGHT;
 static u32 WIN_PIXELS_COUNT;
 static u32 SPACE_VOXELS_COUNT;
 static u32 WIN_BYTES_COUNT;
-static u32 SPACE_BYTES_COUNT;
 static u32 BASE_BYTES_COUNT;
 
 static u16 MAP_WIDTH;
@@ -98,7 +174,6 @@ static u16 MAP_HEIGHT_SCALE;
 static u32 MAP_PIXELS_COUNT;
 static u32 MAP_BYTES_COUNT;
 static u32 MAP_VOXELS_COUNT;
-static u32 MAP_VOLUME_BYTES_COUNT;
 
 static void initGuContext(void* list) {
     sceGuStart(GU_DIRECT, list);
@@ -125,21 +200,59 @@ static void initGuContext(void* list) {
     sceGuSync(GU_SYNC_FINISH, GU_SYNC_WHAT_DONE);
 }
 
-static SceUID f;
 static void openData() {
-    f = sceIoOpen("atoms.apov", PSP_O_RDONLY, 0777);
+    openShards("atoms.apov");
 }
 static void closeData() {
-    sceIoClose(f);
+    closeShards();
 }
 static u64 loffset = -1;
+// Frame occupancy, NULL when unknown or not loaded. Empty frames, as the
+// ones dedup.bin marks, are not read, their mask is cleared.
+static const u8* occupied = NULL;
+// With run length coded masks (apov-transcode -R) the frame offsets follow
+// the header and a frame is its color map then the runs, alternating empty
+// and visible pixels from an empty one, or the mask when not smaller. The
+// packed frame is read after the mask, the runs are kept as is.
+static u32* frameOffsets = NULL;
+static const u16* runs = NULL;
+static u32 runsCount = 0;
+static u8 readPacked(u8* const frame, const u32 index) {
+    u8* const packed = &frame[WIN_BYTES_COUNT];
+    const u32 nbytes = frameOffsets[index + 1] - frameOffsets[index];
+    if(nbytes < MAP_BYTES_COUNT || nbytes > MAP_BYTES_COUNT + WIN_BYTES_COUNT ||
+        nbytes != readShards(packed, frameOffsets[index], nbytes)) {
+        return 0;
+    }
+    if(nbytes == MAP_BYTES_COUNT + WIN_BYTES_COUNT) {
+        memcpy(frame, &packed[MAP_BYTES_COUNT], WIN_BYTES_COUNT);
+    } else {
+        runs = (const u16*)&packed[MAP_BYTES_COUNT];
+        runsCount = (nbytes - MAP_BYTES_COUNT) / sizeof(u16);
+    }
+    return 1;
+}
+
 static u8 readData(u8* const frame, const u64 offset) {
     if(offset != loffset) {
         const u64 nbytes = WIN_BYTES_COUNT + MAP_BYTES_COUNT;
-        sceIoLseek(f, offset + HEADER_BYTES_COUNT, SEEK_SET);
-        if(nbytes != sceIoRead(f, frame, nbytes)) {
-            openData();
-            return 0;
+        occupied = offset == EMPTY_OFFSET ? NULL : getOccupancy(offset / nbytes);
+        runs = NULL;
+        if(offset == EMPTY_OFFSET || (occupied != NULL && isSpanEmpty(occupied, 0, WIN_WIDTH))) {
+            memset(frame, 0, WIN_BYTES_COUNT);
+            loffset = offset;
+            return 1;
+        }
+        if(frameOffsets != NULL) {
+            if(!readPacked(frame, offset / nbytes)) {
+                openData();
+                return 0;
+            }
+        } else {
+            if(nbytes != readShards(frame, offset + HEADER_BYTES_COUNT, nbytes)) {
+                openData();
+                return 0;
+            }
         }
         loffset = offset;
         return 1;
@@ -148,14 +261,39 @@ static u8 readData(u8* const frame, const u64 offset) {
 }
 
 static Cached* cached = NULL;
-static int __attribute__((aligned(16))) em[16] = {0};
+static Smooth* smoothed = NULL;
 void cache() {
     Cached c;
-    cached = memalign(16, WIN_PIXELS_COUNT * sizeof(Cached));
     u16 x = 0;
     while(x < WIN_WIDTH) {
         u16 y = 0;
         while(y < WIN_HEIGHT) {
+            const u32 i = x + y * WIN_WIDTH;
+            const u32 ux = ((float)x) / MAP_WIDTH_SCALE;
+            const u32 uy = ((float)y) / MAP_HEIGHT_SCALE;
+            c.mask = (0b1 << (i % 8));
+            c.moff = (i / 8);
+            c.midx = (ux + uy * MAP_WIDTH);
+            cached[i] = c;
+            y++;
+        }
+        x++;
+    }
+}
+
+// The smoothing factors are only needed by mode 1, they are built a few rows
+// at a time while the view is idle and completed when the mode is selected.
+// Mode 1 is not available when the arena cannot hold them.
+static u16 SMOOTH_ROWS_READY = 0;
+void cacheSmooth(u16 rows) {
+    if(SMOOTH_ROWS_READY == WIN_HEIGHT || smoothed == NULL) {
+        return;
+    }
+    Smooth c;
+    while(rows-- && SMOOTH_ROWS_READY < WIN_HEIGHT) {
+        const u16 y = SMOOTH_ROWS_READY++;
+        u16 x = 0;
+        while(x < WIN_WIDTH) {
             const u32 i = x + y * WIN_WIDTH;
             const float fx = ((float)x) / MAP_WIDTH_SCALE;
             const float fy = ((float)y) / MAP_HEIGHT_SCALE;
@@ -164,9 +302,6 @@ void cache() {
             const u32 uyb = uy * MAP_WIDTH;
             const float hc = fx - ux - 0.5f;
             const float vc = fy - uy - 0.5f;
-            c.mask = (0b1 << (i % 8));
-            c.moff = (i / 8);
-            c.midx = (ux + uyb);
             c.fb = (hc < 0.0f ? -hc : hc);
             c.fc = (vc < 0.0f ? -vc : vc);
             c.fa = 1.0f - (c.fb + c.fc);
@@ -178,38 +313,24 @@ void cache() {
             c.hckb = hc >= 0.0f && ux < (MAP_WIDTH - 1) ? 1 : 0;
             c.vcka = vc < 0.0f && uy > 0 ? 1 : 0;
             c.vckb = vc >= 0.0f && uy < (MAP_HEIGHT - 1) ? 1:0;
-            cached[i] = c;
-            y++;
+            smoothed[i] = c;
+            x++;
         }
-        x++;
-    }
-    
-    if(options.TRACE_EDGES) {
-        const u16 WIN_WIDTH_X2 = WIN_WIDTH * 2;
-        // Edges matrix
-        em[0] = -1;
-        em[1] = +1;
-        em[2] = -WIN_WIDTH;
-        em[3] = +WIN_WIDTH;
-        em[4] = -1-WIN_WIDTH;
-        em[5] = +1+WIN_WIDTH;
-        em[6] = -1+WIN_WIDTH;
-        em[7] = +1-WIN_WIDTH;
-        em[8] = -2;
-        em[9] = +2;
-        em[10] = -WIN_WIDTH_X2;
-        em[11] = +WIN_WIDTH_X2;
-        em[12] = -2-WIN_WIDTH_X2;
-        em[13] = +2+WIN_WIDTH_X2;
-        em[14] = -2+WIN_WIDTH_X2;
-        em[15] = +2-WIN_WIDTH_X2;
     }
 }
  
-void updateView(u8* const frame, u32* const map, u32* const base) {
+KERNEL void spanWith(u8* const frame, u32* const map, u32* const base, const u32 first, const u32 count,
+    const u16 width, const u16 height) {
+    const u32 last = first + count;
+    // Edges matrix
+    const int w2 = width * 2;
+    const int edges[16] = {
+        -1, +1, -width, +width, -1-width, +1+width, -1+width, +1-width,
+        -2, +2, -w2, +w2, -2-w2, +2+w2, -2+w2, +2-w2
+    };
     if(MODE == 0) {
-        u32 i = 0;
-        while(i < WIN_PIXELS_COUNT) {
+        u32 i = first;
+        while(i < last) {
             Cached* const cache = &(cached[i]);
             if(frame[cache->moff] & cache->mask) {
                 base[i] = map[cache->midx] | 0xFF << 24;
@@ -217,50 +338,51 @@ void updateView(u8* const frame, u32* const map, u32* const base) {
             i++;
         }
     } else if(MODE == 1) {
-        u32 i = 0;
-        while(i < WIN_PIXELS_COUNT) {
+        u32 i = first;
+        while(i < last) {
             Cached* const cache = &(cached[i]);
             if(frame[cache->moff] & cache->mask) {
+                Smooth* const smooth = &(smoothed[i]);
                 u32 b, c;
                 const u32 a = map[cache->midx];
-                if(cache->hcka) {
-                    b = map[cache->hoa];
-                } else if(cache->hckb) {
-                    b = map[cache->hob];
+                if(smooth->hcka) {
+                    b = map[smooth->hoa];
+                } else if(smooth->hckb) {
+                    b = map[smooth->hob];
                 } else b = 0;
                 
-                if(cache->vcka) {
-                    c = map[cache->voa];
-                } else if(cache->vckb) {
-                    c = map[cache->vob];
+                if(smooth->vcka) {
+                    c = map[smooth->voa];
+                } else if(smooth->vckb) {
+                    c = map[smooth->vob];
                 } else c = 0;
                
                 const u8 R = (u8)(
-                    ((a & 0xFF) * cache->fa) +
-                    ((b & 0xFF) * cache->fb) +
-                    ((c & 0xFF) * cache->fc));
+                    ((a & 0xFF) * smooth->fa) +
+                    ((b & 0xFF) * smooth->fb) +
+                    ((c & 0xFF) * smooth->fc));
                 
                 const u8 G = (u8)(
-                    (((a >> 8) & 0xFF) * cache->fa) +
-                    (((b >> 8) & 0xFF) * cache->fb) +
-                    (((c >> 8) & 0xFF) * cache->fc));
+                    (((a >> 8) & 0xFF) * smooth->fa) +
+                    (((b >> 8) & 0xFF) * smooth->fb) +
+                    (((c >> 8) & 0xFF) * smooth->fc));
                 
                 const u8 B = (u8)(
-                    (((a >> 16) & 0xFF) * cache->fa) +
-                    (((b >> 16) & 0xFF) * cache->fb) +
-                    (((c >> 16) & 0xFF) * cache->fc));
+                    (((a >> 16) & 0xFF) * smooth->fa) +
+                    (((b >> 16) & 0xFF) * smooth->fb) +
+                    (((c >> 16) & 0xFF) * smooth->fc));
 
                 base[i] = R | G << 8 | B << 16 | 0xFF << 24;
             } else {
-                if(options.TRACE_EDGES) {
-                    const u16 x = i % WIN_WIDTH;
-                    const u16 y = i / WIN_WIDTH;
-                    if(x >= 2 && x < (WIN_WIDTH - 2) &&
-                       y >= 2 && y < (WIN_HEIGHT - 2)) {
+                if(TRACE_EDGES) {
+                    const u16 x = i % width;
+                    const u16 y = i / width;
+                    if(x >= 2 && x < (width - 2) &&
+                       y >= 2 && y < (height - 2)) {
                         u8 n = 0;
                         while(n < 16) {
-                            Cached* const ca = &(cached[i + em[n]]);
-                            Cached* const cb = &(cached[i + em[n + 1]]);
+                            Cached* const ca = &(cached[i + edges[n]]);
+                            Cached* const cb = &(cached[i + edges[n + 1]]);
                             const u8 count =
                                 ((frame[ca->moff] & ca->mask) ? 1 : 0) +  
                                 ((frame[cb->moff] & cb->mask) ? 1 : 0);
@@ -285,6 +407,198 @@ void updateView(u8* const frame, u32* const map, u32* const base) {
     }
 }
 
+// Spans are composed by a kernel specialized for the window width when
+// there is one, so the pixel coordinates and edge offsets are constants
+typedef void (*SpanKernel)(u8* const frame, u32* const map, u32* const base, const u32 first,
+    const u32 count);
+static void updateSpanAny(u8* const frame, u32* const map, u32* const base, const u32 first, const u32 count) {
+    spanWith(frame, map, base, first, count, WIN_WIDTH, WIN_HEIGHT);
+}
+static void updateSpan256(u8* const frame, u32* const map, u32* const base, const u32 first, const u32 count) {
+    spanWith(frame, map, base, first, count, 256, 256);
+}
+static void updateSpan512(u8* const frame, u32* const map, u32* const base, const u32 first, const u32 count) {
+    spanWith(frame, map, base, first, count, 512, 256);
+}
+static SpanKernel updateSpan = updateSpanAny;
+
+enum {
+    SPAN_ANY = 0,
+    SPAN_256,
+    SPAN_512
+};
+static const SpanKernel SPAN_KERNELS[] = {updateSpanAny, updateSpan256, updateSpan512};
+static const char* const SPAN_NAMES[] = {"generic", "256x256", "512x256"};
+static u8 SPAN_GEOMETRY = SPAN_ANY;
+
+static void selectKernels() {
+    if(WIN_HEIGHT == 256 && WIN_WIDTH == 256) {
+        SPAN_GEOMETRY = SPAN_256;
+    } else if(WIN_HEIGHT == 256 && WIN_WIDTH == 512) {
+        SPAN_GEOMETRY = SPAN_512;
+    } else SPAN_GEOMETRY = SPAN_ANY;
+    updateSpan = SPAN_KERNELS[SPAN_GEOMETRY];
+}
+
+// Mode 0 straight from the runs, empty runs are cleared at once and the
+// visible ones take their map color without testing the mask
+static void updateRuns(const u32* const map, u32* const base) {
+    u32 i = 0;
+    u32 r = 0;
+    while(r < runsCount && i < WIN_PIXELS_COUNT) {
+        u32 last = i + runs[r++];
+        last = last < WIN_PIXELS_COUNT ? last : WIN_PIXELS_COUNT;
+        memset(&base[i], 0, (last - i) * sizeof(u32));
+        i = last;
+        if(r < runsCount) {
+            last = i + runs[r++];
+            last = last < WIN_PIXELS_COUNT ? last : WIN_PIXELS_COUNT;
+            while(i < last) {
+                base[i] = map[cached[i].midx] | 0xFF << 24;
+                i++;
+            }
+        }
+    }
+    memset(&base[i], 0, (WIN_PIXELS_COUNT - i) * sizeof(u32));
+}
+
+static void setMaskBits(u8* const frame, u32 first, const u32 last) {
+    while(first < last && first % 8) {
+        frame[first / 8] |= 1 << (first % 8);
+        first++;
+    }
+    const u32 bytes = (last - first) / 8;
+    memset(&frame[first / 8], 0xFF, bytes);
+    first += bytes * 8;
+    while(first < last) {
+        frame[first / 8] |= 1 << (first % 8);
+        first++;
+    }
+}
+
+// The smoothing and edges look at the neighbours, the mask is rebuilt
+static void expandRuns(u8* const frame) {
+    memset(frame, 0, WIN_BYTES_COUNT);
+    u32 i = 0;
+    u32 r = 0;
+    while(r < runsCount) {
+        i += runs[r++];
+        if(r < runsCount) {
+            const u32 last = i + runs[r++];
+            setMaskBits(frame, i, last < WIN_PIXELS_COUNT ? last : WIN_PIXELS_COUNT);
+            i = last;
+        }
+    }
+}
+
+// Bands are DIRTY_ROWS rows of the window. A band depends on the mask rows
+// up to 2 pixels around it for the edges, and on the map rows around it for
+// the smoothing.
+static void markBands(const u8* const frame, const u32* const map) {
+    if(!isTracking()) {
+        return;
+    }
+    const u32 rowBytes = WIN_WIDTH / 8;
+    u32 band = 0;
+    while(band < BANDS_COUNT) {
+        const u32 y0 = band ? band * DIRTY_ROWS - 2 : 0;
+        const u32 y1 = band + 1 < BANDS_COUNT ? (band + 1) * DIRTY_ROWS + 2 : WIN_HEIGHT;
+        const u32 my0 = y0 / MAP_HEIGHT_SCALE ? y0 / MAP_HEIGHT_SCALE - 1 : 0;
+        const u32 my1 = (y1 - 1) / MAP_HEIGHT_SCALE + 1 < MAP_HEIGHT ?
+            (y1 - 1) / MAP_HEIGHT_SCALE + 1 : MAP_HEIGHT - 1;
+        const u32 hash = hashWords((const u32*)&frame[y0 * rowBytes],
+            (y1 - y0) * rowBytes / sizeof(u32), 5381);
+        updateBand(band, hashWords(&map[my0 * MAP_WIDTH], (my1 - my0 + 1) * MAP_WIDTH, hash));
+        band++;
+    }
+}
+
+// Mode 0 is composed from the runs, over the whole mask or over the
+// occupied cells, the fastest one is picked at startup, see tune.h
+enum {
+    MASK_BITS = 0,
+    MASK_CELLS,
+    MASK_RUNS
+};
+static u8 MASK_KERNEL = MASK_CELLS;
+
+// Only the changed bands and occupied cells are composed, with their
+// neighbours for the smoothing and edges, the others are cleared
+void updateView(u8* const frame, u32* const map, u32* const base) {
+    if(runs != NULL) {
+        if(MODE == 0 && MASK_KERNEL == MASK_RUNS) {
+            // Cheaper than rebuilding the mask to track the bands
+            invalidateBands();
+            updateRuns(map, base);
+            return;
+        }
+        expandRuns(frame);
+    }
+    markBands(frame, map);
+    if(occupied == NULL || (MODE == 0 && MASK_KERNEL == MASK_BITS)) {
+        const u32 pixels = DIRTY_ROWS * WIN_WIDTH;
+        u16 band = 0;
+        while(band < WIN_HEIGHT / DIRTY_ROWS) {
+            if(isBandChanged(band)) {
+                updateSpan(frame, map, base, band * pixels, pixels);
+            }
+            band++;
+        }
+        return;
+    }
+    u16 cy = 0;
+    while(cy < OCCUPANCY_ROWS) {
+        if(!isBandChanged(cy)) {
+            cy++;
+            continue;
+        }
+        u16 cx = 0;
+        while(cx < OCCUPANCY_COLUMNS) {
+            const u8 used = MODE ? isCellNear(occupied, cx, cy) : isCellOccupied(occupied, cx, cy);
+            const u32 first = cy * OCCUPANCY_CELL * WIN_WIDTH + cx * OCCUPANCY_CELL;
+            u8 y = 0;
+            while(y < OCCUPANCY_CELL) {
+                if(used) {
+                    updateSpan(frame, map, base, first + y * WIN_WIDTH, OCCUPANCY_CELL);
+                } else memset(&base[first + y * WIN_WIDTH], 0, OCCUPANCY_CELL * sizeof(u32));
+                y++;
+            }
+            cx++;
+        }
+        cy++;
+    }
+}
+
+// The candidates compose the tuning frame in mode 0
+static u8* tuneFrame;
+static void tuneMask(u32* const base, const u8 kernel) {
+    MASK_KERNEL = kernel;
+    invalidateBands();
+    updateView(tuneFrame, (u32*)&tuneFrame[WIN_BYTES_COUNT], base);
+}
+static void maskBits(void* const base) {
+    tuneMask(base, MASK_BITS);
+}
+static void maskCells(void* const base) {
+    tuneMask(base, MASK_CELLS);
+}
+static void maskRuns(void* const base) {
+    tuneMask(base, MASK_RUNS);
+}
+
+// The specialized span kernel is timed against the generic one over the
+// whole mask, so tune.txt holds their times on the PSP
+static void tuneSpan(u32* const base, const u8 kernel) {
+    updateSpan = SPAN_KERNELS[kernel];
+    tuneMask(base, MASK_BITS);
+}
+static void spanAny(void* const base) {
+    tuneSpan(base, SPAN_ANY);
+}
+static void spanSpecialized(void* const base) {
+    tuneSpan(base, SPAN_GEOMETRY);
+}
+
 static int ajustCursor(const int value, const u8 mode) {
     if(!mode) {
         u16 max;
@@ -312,8 +626,7 @@ static int ajustCursor(const int value, const u8 mode) {
 
 static u64 getOffset(const int move, const int hrotate, const int vrotate) {
     const u32 pov = (hrotate * options.VERTICAL_POV_COUNT + vrotate);
-    return (WIN_BYTES_COUNT + MAP_BYTES_COUNT) * move +
-        pov * (SPACE_BYTES_COUNT + MAP_VOLUME_BYTES_COUNT);
+    return getSlotOffset(getFrameIndex(pov, move), 0, WIN_BYTES_COUNT + MAP_BYTES_COUNT);
 }
 
 SceCtrlData pad;
@@ -323,7 +636,10 @@ static u64 controls() {
     static int vrotate = 0;
     static SceCtrlData lpad;
     
-    sceCtrlReadBufferPositive(&pad, 1);
+    if(!replayPad(&pad)) {
+        latchPad(&pad);
+        recordPad(&pad);
+    }
     
     if(pad.Buttons & PSP_CTRL_TRIANGLE) { move++; }
     if(pad.Buttons & PSP_CTRL_CROSS) { move--; }
@@ -338,11 +654,41 @@ static u64 controls() {
     
     if((pad.Buttons & PSP_CTRL_SQUARE) &&
         !(lpad.Buttons & PSP_CTRL_SQUARE)) {
-        MODE = (MODE + 1) % 2;
+        MODE_SELECTED = (MODE_SELECTED + 1) % (smoothed != NULL ? 2 : 1);
+    }
+    
+    // While navigating the quality levels skip the edges, then the
+    // smoothing, when they are in use, see quality.h
+    u8 steps[2];
+    u8 count = 0;
+    if(options.TRACE_EDGES) {
+        steps[count++] = DROP_EDGES;
+    }
+    if(MODE_SELECTED) {
+        steps[count++] = DROP_SMOOTHING;
+    }
+    setQualitySteps(steps, count);
+    const u8 moving = (pad.Buttons & QUALITY_BUTTONS) != 0;
+    const u8 mode = moving && isQualityDropped(DROP_SMOOTHING) ? 0 : MODE_SELECTED;
+    const u8 edges = options.TRACE_EDGES && !(moving && isQualityDropped(DROP_EDGES));
+    if(mode != MODE || edges != TRACE_EDGES) {
+        MODE = mode;
+        TRACE_EDGES = edges;
+        cacheSmooth(WIN_HEIGHT);
+        invalidateBands();
         loffset = -1;
     }
     lpad = pad;
     
+    if(TEXTURE_WIDTH > SCREEN_WIDTH) {
+        const u16 x = VIEW_X;
+        if((pad.Buttons & PSP_CTRL_LTRIGGER) && VIEW_X >= P) { VIEW_X -= P; }
+        if((pad.Buttons & PSP_CTRL_RTRIGGER) && VIEW_X + SCREEN_WIDTH + P <= TEXTURE_WIDTH) { VIEW_X += P; }
+        if(x != VIEW_X) {
+            generateRenderSurface();
+        }
+    }
+    
     return getOffset(move, hrotate, vrotate);
 }
 
@@ -363,12 +709,34 @@ void getOptions() {
     if(f != NULL) {
         fread(&options, sizeof(Options), 1, f);
         fclose(f);
+        POV_BLOCK = options.POV_BLOCK;
+        DEPTH_BLOCK = options.DEPTH_BLOCK;
+    }
+    
+    // The geometry comes from the header, options.txt only holds settings
+    f = fopen("options.txt", "r");
+    if(f != NULL) {
+        char settings[128];
+        fgets(settings, sizeof(settings), f);
+        LATE_LATCH = strstr(settings, "LATCH:1") != NULL;
+        ON_CHANGE = strstr(settings, "ONCHANGE:1") != NULL;
+        HUD = strstr(settings, "HUD:0") == NULL;
+        DIRTY = strstr(settings, "DIRTY:1") != NULL;
+        TUNE = strstr(settings, "TUNE:1") != NULL;
+        getBlockSettings(settings);
+        getProbeSettings(settings);
+        getQualitySettings(settings);
+        getReplaySettings(settings);
+        fclose(f);
     }
 }
    
 int main() {
+    profileStep("start");
     scePowerSetClockFrequency(333, 333, 166);    
     getOptions();
+    TRACE_EDGES = options.TRACE_EDGES;
+    profileStep("options");
     
     const u16 DEPTH_FRAME_COUNT = ((options.DEPTH_BLOCK_COUNT *
         options.SPACE_BLOCK_SIZE) / options.RAY_STEP);
@@ -377,10 +745,10 @@ int main() {
     WIN_HEIGHT = options.SPACE_BLOCK_SIZE;
     WIN_PIXELS_COUNT = WIN_WIDTH * WIN_HEIGHT;
     SPACE_VOXELS_COUNT = DEPTH_FRAME_COUNT * WIN_PIXELS_COUNT;
+    setLayout(options.HORIZONTAL_POV_COUNT * options.VERTICAL_POV_COUNT, DEPTH_FRAME_COUNT);
     
     BASE_BYTES_COUNT = WIN_PIXELS_COUNT * 8;
     WIN_BYTES_COUNT = WIN_PIXELS_COUNT / 8;
-    SPACE_BYTES_COUNT = SPACE_VOXELS_COUNT / 8;
     
     MAP_WIDTH = options.COLOR_MAP_SIZE * options.WIDTH_BLOCK_COUNT;
     MAP_HEIGHT = options.COLOR_MAP_SIZE;
@@ -388,66 +756,198 @@ int main() {
     MAP_BYTES_COUNT = MAP_PIXELS_COUNT * sizeof(u32);
     MAP_VOXELS_COUNT = DEPTH_FRAME_COUNT * MAP_PIXELS_COUNT;
 
-    MAP_VOLUME_BYTES_COUNT = MAP_VOXELS_COUNT * sizeof(u32);
     MAP_WIDTH_SCALE = WIN_WIDTH / MAP_WIDTH;
     MAP_HEIGHT_SCALE = WIN_HEIGHT / MAP_HEIGHT;
     
     TEXTURE_WIDTH = TEXTURE_BLOCK_SIZE * options.WIDTH_BLOCK_COUNT;
     
-    cache();
-    
-    u32* base = memalign(16, BASE_BYTES_COUNT);
-    u8* frame = memalign(16, WIN_BYTES_COUNT + MAP_BYTES_COUNT);
+    // Every buffer lives in one arena sized from the header, the smoothing
+    // table is optional and dropped first on a full heap
+    u32* base;
+    u8* frame;
+    void* list;
+    planBuffer("list", &list, 1024, 0);
+    planBuffer("frame", &frame, WIN_BYTES_COUNT * (options.MASK_RUNS ? 2 : 1) + MAP_BYTES_COUNT, 0);
+    planBuffer("base", &base, BASE_BYTES_COUNT, 0);
+    planBuffer("surface", &surface, getSurfaceBytes(), 0);
+    planBuffer("draw list", &drawList, DRAW_LIST_BYTES_COUNT, 0);
+    planBuffer("masks", &cached, WIN_PIXELS_COUNT * sizeof(Cached), 0);
+    const u32 FRAMES_COUNT = options.HORIZONTAL_POV_COUNT * options.VERTICAL_POV_COUNT * DEPTH_FRAME_COUNT;
+    if(options.MASK_RUNS) {
+        planBuffer("frame offsets", &frameOffsets, (FRAMES_COUNT + 1) * sizeof(u32), 0);
+    }
+    // Packed frames are not deduplicated, see apov-transcode -D
+    u32 stored = FRAMES_COUNT;
+    const u32 dedupBytes = options.MASK_RUNS ? 0 : openDedup(FRAMES_COUNT, &stored);
+    if(dedupBytes) {
+        planBuffer("frame slots", &frameSlots, dedupBytes, 0);
+    }
+    const u32 occupancyBytes = openOccupancy(WIN_WIDTH, WIN_HEIGHT, stored);
+    if(occupancyBytes) {
+        planBuffer("occupancy", &occupancy, occupancyBytes, 1);
+    }
+    planBlocks();
+    planProbe(WIN_PIXELS_COUNT, options.WIDTH_BLOCK_COUNT, options.COLOR_MAP_SIZE);
+    planHud();
+    planDirty(WIN_HEIGHT / DIRTY_ROWS);
+    planBuffer("smoothing", &smoothed, WIN_PIXELS_COUNT * sizeof(Smooth), 1);
+    const u32 frames = openReplay();
+    if(frames) {
+        planBuffer("replay times", &replayTimes, frames * sizeof(u32), 0);
+    }
+    requireArena("memory.txt");
+    loadDedup();
+    loadOccupancy();
+    buildHudAtlas();
     
-    void* list = memalign(16, 256);
+    cache();
+    selectKernels();
+    profileStep("mask tables");
     
     generateRenderSurface();
+    profileStep("buffers");
     sceGuInit();
     initGuContext(list);
     pspDebugScreenInitEx(NULL, PSP_DISPLAY_PIXEL_FORMAT_8888, 0);
     pspDebugScreenEnableBackColor(0);
+    profileStep("gu");
     
     openData();
+    if(frameOffsets != NULL) {
+        const u32 nbytes = (FRAMES_COUNT + 1) * sizeof(u32);
+        if(nbytes != readShards(frameOffsets, HEADER_BYTES_COUNT, nbytes)) {
+            memset(frameOffsets, 0, nbytes);
+        }
+    }
+    profileStep("open");
+    
+    if(PROBE) {
+        // Packed frames end where the offset table says
+        const u64 span = frameOffsets != NULL && frameOffsets[FRAMES_COUNT] > HEADER_BYTES_COUNT ?
+            frameOffsets[FRAMES_COUNT] - HEADER_BYTES_COUNT : (u64)stored * (WIN_BYTES_COUNT + MAP_BYTES_COUNT);
+        runProbe(HEADER_BYTES_COUNT, span, options.VERTICAL_POV_COUNT);
+        profileStep("probe");
+    }
+    
+    Candidate masks[3] = {{MASK_BITS, "bits", maskBits}};
+    u8 count = 1;
+    if(occupancy != NULL) {
+        const Candidate cells = {MASK_CELLS, "cells", maskCells};
+        masks[count++] = cells;
+    }
+    if(frameOffsets != NULL) {
+        const Candidate packed = {MASK_RUNS, "runs", maskRuns};
+        masks[count++] = packed;
+    }
+    // Tuned on the depth of the first POV with the most occupied cells, the
+    // middle one without occupancy, as the first slices are often empty
+    int tuneMove = DEPTH_FRAME_COUNT / 2;
+    u32 most = 0;
+    int move = 0;
+    while(move < DEPTH_FRAME_COUNT) {
+        const u64 offset = getOffset(move, 0, 0);
+        const u8* const record = offset == EMPTY_OFFSET ? NULL :
+            getOccupancy(offset / (WIN_BYTES_COUNT + MAP_BYTES_COUNT));
+        const u32 cells = record != NULL ? getOccupiedCells(record) : 0;
+        if(cells > most) {
+            most = cells;
+            tuneMove = move;
+        }
+        move++;
+    }
+    tuneFrame = frame;
+    readData(frame, getOffset(tuneMove, 0, 0));
+    if(SPAN_GEOMETRY != SPAN_ANY) {
+        const Candidate spans[2] = {
+            {SPAN_ANY, SPAN_NAMES[SPAN_ANY], spanAny},
+            {SPAN_GEOMETRY, SPAN_NAMES[SPAN_GEOMETRY], spanSpecialized}
+        };
+        updateSpan = SPAN_KERNELS[pickKernel("SPAN", spans, 2, base)];
+    }
+    MASK_KERNEL = pickKernel("MODE0", masks, count, base);
+    writeTuned();
+    loffset = -1;
+    profileStep("tune");
     
     int dbuff = 0;
     u64 prev, now, fps = 0;
+    u32 frameUs = 0;
+    u16 lview = -1;
     const u64 tickResolution = sceRtcGetTickResolution();
 
     do {
         sceRtcGetCurrentTick(&prev);
+        latencyWait();
+        
+        // The displayed buffer is kept as long as the view does not change
+        const u64 offset = controls();
+        startQuality();
+        const u8 updated = readData(frame, offset);
+        if(ON_CHANGE && !updated && VIEW_X == lview) {
+            if(!pad.Buttons) {
+                cacheSmooth(8);
+            }
+            latencyIdle();
+            replayVblank();
+            latencyVblank();
+            replayFrameDone();
+            continue;
+        }
+        lview = VIEW_X;
+        
+        if(!LIST_READY) {
+            buildDrawList(base);
+        }
         sceGuStart(GU_DIRECT, list);
         sceGuClear(GU_COLOR_BUFFER_BIT);
         
-        if(readData(frame, controls())) {
+        if(updated) {
             updateView(frame, (u32*)&frame[WIN_BYTES_COUNT], base);
         }
+        endQuality(&pad);
+        sceGuCallList(drawList);
         
-        sceGuTexImage(0, TEXTURE_WIDTH, TEXTURE_BLOCK_SIZE, TEXTURE_WIDTH, base);        
-        sceGumDrawArray(GU_SPRITES, GU_TEXTURE_16BIT|GU_TRANSFORM_2D|GU_VERTEX_16BIT,
-        VERTICES_COUNT, 0, surface);
+        hudPrintf("Fps: %llu, frame: %u us, HUD: %u us\n", fps, frameUs, getHudUs());
+        hudPrintf("Press [ ] to %s smoothing\n", MODE_SELECTED ? "disable" : "enable");
+        hudPrintf("Startup: %u ms, memory: %u KB\n", getStartupMs(), arenaSize / 1024);
+        printLatency();
+        printDirty();
+        printBlocks();
+        printProbe();
+        printQuality();
+        drawHud();
         
         sceGuFinish();
         sceGuSync(GU_SYNC_FINISH, GU_SYNC_WHAT_DONE);
+        printHud(dbuff);
         
-        pspDebugScreenSetOffset(dbuff);
-        pspDebugScreenSetXY(0, 0);
-        pspDebugScreenSetTextColor(0xFF00A0FF);
-        pspDebugScreenPrintf("Fps: %llu\n", fps);
-        pspDebugScreenPrintf("Press [ ] to %s smoothing\n", MODE ? "disable" : "enable");
+        if(!pad.Buttons) {
+            cacheSmooth(8);
+        }
         
-        sceDisplayWaitVblankStart(); 
+        latencyWorkDone();
+        replayVblank();
+        latencyVblank();
         dbuff = (int)sceGuSwapBuffers();
+        latencySwap();
+        profileFirstFrame("startup.txt");
         
         sceRtcGetCurrentTick(&now);
         fps = tickResolution / (now - prev);
+        frameUs = ((now - prev) * 1000000) / tickResolution;
+        replayFrameDone();
     } while(!(pad.Buttons & PSP_CTRL_SELECT));
     
+    writeLatency("latency.txt");
+    writeDirty("dirty.txt");
+    writeBlocks("io.txt");
+    writeProbe("probe.txt");
+    writeQuality("quality.txt");
+    writeHud("hud.txt");
+    closeReplay("replay.txt");
+    
     sceGuTerm();
-    free(surface);
-    free(list);
-    free(base);
-    free(frame);
-    free(cached);
+    freeArena();
     closeData();
     sceKernelExitGame();
     return 0;
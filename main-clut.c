@@ -13,6 +13,17 @@
 #include <psprtc.h>
 #include <psppower.h>
 #include <pspdisplay.h>
+#include "profile.h"
+#include "arena.h"
+#include "hud.h"
+#include "latency.h"
+#include "replay.h"
+#include "occupancy.h"
+#include "layout.h"
+#include "dedup.h"
+#include "blockio.h"
+#include "shards.h"
+#include "probe.h"
 
 #define TEXTURE_BLOCK_SIZE 256
 #define BUFFER_WIDTH 512
@@ -37,30 +48,79 @@ typedef struct Vertex {
 #define CLUT_COLOR_COUNT 256
 static u32 __attribute__((aligned(16))) clut[CLUT_COLOR_COUNT] = {0};
  
+#define VISIBLE_TILES_COUNT 3
+#define LOD_LEVELS_COUNT 3
+ 
 static u16 VERTICES_COUNT;
 static u16 TEXTURE_WIDTH;
 static Vertex* surface;
+static Vertex* lodSurfaces[LOD_LEVELS_COUNT];
+static u8 LOD_COUNT = 1;
+static u8 ON_CHANGE = 0;
+
+// Horizontal viewport over the texture tiles, panned with L/R
+static u16 VIEW_X = 0;
+static u8 FIRST_TILE;
+static u8 LAST_TILE;
+static u16 TILE_FIRST_VERTEX[VISIBLE_TILES_COUNT];
+static u16 TILE_VERTICES_COUNT[VISIBLE_TILES_COUNT];
+
+// The tiles of each level are drawn by a call list, built again once the
+// surface changes
+#define DRAW_LIST_BYTES_COUNT 256
+static u8* drawLists;
+static u8 LISTS_READY = 0;
+
+#define VERTICES_BY_BLOCK 2
+static u32 getSurfaceBytes() {
+    const u16 VIEW_WIDTH = TEXTURE_WIDTH < SCREEN_WIDTH ? TEXTURE_WIDTH : SCREEN_WIDTH;
+    return sizeof(Vertex) * VERTICES_BY_BLOCK * (TEXTURE_BLOCK_SIZE / P) * (VIEW_WIDTH / P);
+}
 
 void generateRenderSurface() {
-    const u8 VERTICES_BY_BLOCK = 2;
-    VERTICES_COUNT = VERTICES_BY_BLOCK * (TEXTURE_BLOCK_SIZE / P) * (TEXTURE_WIDTH / P);
-    surface = memalign(16, sizeof(Vertex) * VERTICES_COUNT);
-    const u16 X = (SCREEN_WIDTH - TEXTURE_WIDTH) / 2;
+    const u16 VIEW_WIDTH = TEXTURE_WIDTH < SCREEN_WIDTH ? TEXTURE_WIDTH : SCREEN_WIDTH;
+    const u16 X = (SCREEN_WIDTH - VIEW_WIDTH) / 2;
     const u16 Y = (SCREEN_HEIGHT - TEXTURE_BLOCK_SIZE) / 2;
-    u16 x = 0;
+    FIRST_TILE = VIEW_X / TEXTURE_BLOCK_SIZE;
+    LAST_TILE = (VIEW_X + VIEW_WIDTH - 1) / TEXTURE_BLOCK_SIZE;
+    u16 x = VIEW_X;
     u16 offset = 0;
-    while(x < TEXTURE_WIDTH) {
+    while(x < VIEW_X + VIEW_WIDTH) {
+        const u8 slot = x / TEXTURE_BLOCK_SIZE - FIRST_TILE;
+        const u16 u = x % TEXTURE_BLOCK_SIZE;
+        const u16 sx = X + x - VIEW_X;
+        if(x == VIEW_X || !u) {
+            TILE_FIRST_VERTEX[slot] = offset;
+        }
         u16 y = 0;
         while(y < TEXTURE_BLOCK_SIZE) {
-            const Vertex a = {x,   y,   X+x,   Y+y,   0};
-            const Vertex b = {x+T, y+T, X+x+P, Y+y+P, 0};
+            const Vertex a = {u,   y,   sx,   Y+y,   0};
+            const Vertex b = {u+T, y+T, sx+P, Y+y+P, 0};
             surface[offset + 0] = a;
             surface[offset + 1] = b;
             offset += VERTICES_BY_BLOCK;
             y += P;
         }
+        TILE_VERTICES_COUNT[slot] = offset - TILE_FIRST_VERTEX[slot];
         x += P;
     }
+    VERTICES_COUNT = offset;
+    sceKernelDcacheWritebackRange(surface, sizeof(Vertex) * VERTICES_COUNT);
+    
+    // Same surface sampling the reduced frames, upscaled by the GE
+    u8 level = 1;
+    while(level < LOD_COUNT) {
+        Vertex* const lsurface = lodSurfaces[level];
+        u16 i = VERTICES_COUNT;
+        while(i--) {
+            lsurface[i] = surface[i];
+            lsurface[i].u >>= level;
+            lsurface[i].v >>= level;
+        }
+        sceKernelDcacheWritebackRange(lsurface, sizeof(Vertex) * VERTICES_COUNT);
+        level++;
+    }
+    LISTS_READY = 0;
 }
 
 #define SPACE_BLOCK_SIZE 256
@@ -73,7 +133,8 @@ static u16 WIN_WIDTH;
 static u16 WIN_HEIGHT = SPACE_BLOCK_SIZE;
 static u32 WIN_PIXELS_COUNT;
 static u32 FRAME_INDICES_COUNT;
-static u32 SPACE_INDICES_COUNT;
+static u8 TILED = 0;
+static u32 TILE_INDICES_COUNT;
 
 static void initGuContext(void* list) {
     sceGuStart(GU_DIRECT, list);
@@ -103,32 +164,161 @@ static void initGuContext(void* list) {
     sceGuSync(GU_SYNC_FINISH, GU_SYNC_WHAT_DONE);
 }
 
-static SceUID f;
 static void openCloseIo(const u8 open) {
     if(open) {
-        f = sceIoOpen("clut-indexes.bin", PSP_O_RDONLY, 0777);
-    } else sceIoClose(f);
+        openShards("clut-indexes.bin");
+    } else closeShards();
 }
 
+// Optional half and quarter resolution captures, stored as tiles, shown
+// while a direction is held
+static const char* const LOD_FILES[LOD_LEVELS_COUNT] = {
+    NULL, "clut-indexes-lod1.bin", "clut-indexes-lod2.bin"
+};
+static SceUID lods[LOD_LEVELS_COUNT];
+static u8* lodFrames[LOD_LEVELS_COUNT];
+static u64* lodOffsets[LOD_LEVELS_COUNT];
+static void openLods() {
+    while(LOD_COUNT < LOD_LEVELS_COUNT &&
+        (lods[LOD_COUNT] = sceIoOpen(LOD_FILES[LOD_COUNT], PSP_O_RDONLY, 0777)) >= 0) {
+        LOD_COUNT++;
+    }
+}
+static void closeLods(const u8 count) {
+    while(LOD_COUNT > count) {
+        sceIoClose(lods[--LOD_COUNT]);
+    }
+}
 
+static void readLod(const u64 offset, const u8 level) {
+    const u32 nbytes = TILE_INDICES_COUNT >> (level * 2);
+    const u64 loffset = offset == EMPTY_OFFSET ? EMPTY_OFFSET : offset >> (level * 2);
+    u8 tile = FIRST_TILE;
+    while(tile <= LAST_TILE) {
+        if(loffset == EMPTY_OFFSET && loffset != lodOffsets[level][tile]) {
+            memset(&lodFrames[level][tile * nbytes], 0, nbytes);
+            lodOffsets[level][tile] = loffset;
+        } else if(loffset != lodOffsets[level][tile]) {
+            sceIoLseek(lods[level], loffset + tile * nbytes, SEEK_SET);
+            if(nbytes != sceIoRead(lods[level], &lodFrames[level][tile * nbytes], nbytes)) {
+                lodOffsets[level][tile] = -1;
+            } else lodOffsets[level][tile] = loffset;
+        }
+        tile++;
+    }
+}
+
+// Records the texture and draw commands of the visible tiles once per level,
+// the frame list only clears and calls the list of the shown level
+static void buildDrawLists(u8* const base) {
+    u8 level = 0;
+    while(level < LOD_COUNT) {
+        u8* const drawList = &drawLists[level * DRAW_LIST_BYTES_COUNT];
+        u8* const texture = level ? lodFrames[level] : base;
+        Vertex* const vertices = level ? lodSurfaces[level] : surface;
+        const u16 width = TEXTURE_BLOCK_SIZE >> level;
+        sceKernelDcacheWritebackInvalidateRange(drawList, DRAW_LIST_BYTES_COUNT);
+        sceGuStart(GU_CALL, drawList);
+        sceGuTexMode(GU_PSM_T8, 0, 0, 0);
+        sceGuTexFunc(GU_TFX_REPLACE, GU_TCC_RGB);
+        sceGuTexFilter(level ? GU_LINEAR : GU_NEAREST, level ? GU_LINEAR : GU_NEAREST);
+        u8 tile = FIRST_TILE;
+        while(tile <= LAST_TILE) {
+            const u8 slot = tile - FIRST_TILE;
+            sceGuTexImage(0, width, width, width, &texture[tile * (TILE_INDICES_COUNT >> (level * 2))]);
+            sceGuDrawArray(GU_SPRITES, GU_TEXTURE_16BIT|GU_TRANSFORM_2D|GU_VERTEX_16BIT,
+            TILE_VERTICES_COUNT[slot], 0, &vertices[TILE_FIRST_VERTEX[slot]]);
+            tile++;
+        }
+        sceGuFinish();
+        level++;
+    }
+    LISTS_READY = 1;
+}
+
+
+// Untiled wide frames are read as the rows spanning the tiles first to last
+// in one call, then scattered to the tiles not held yet. Without the buffer
+// the rows are read in file order across the tiles, so the read window
+// loads each of them once.
+static u64* loffsets;
+static u8* rows = NULL;
+static u8 readRows(u8* const frame, const u64 offset, const u8 first, const u8 last) {
+    const u32 span = (TEXTURE_BLOCK_SIZE - 1) * WIN_WIDTH + (last - first + 1) * TEXTURE_BLOCK_SIZE;
+    if(rows != NULL && span != readShards(rows, offset + first * TEXTURE_BLOCK_SIZE, span)) {
+        openCloseIo(1);
+        return 0;
+    }
+    u16 y = 0;
+    while(y < TEXTURE_BLOCK_SIZE) {
+        u8 tile = first;
+        while(tile <= last) {
+            if(offset != loffsets[tile]) {
+                u8* const indices = &frame[tile * TILE_INDICES_COUNT + y * TEXTURE_BLOCK_SIZE];
+                if(rows != NULL) {
+                    memcpy(indices, &rows[y * WIN_WIDTH + (tile - first) * TEXTURE_BLOCK_SIZE], TEXTURE_BLOCK_SIZE);
+                } else if(TEXTURE_BLOCK_SIZE != readShards(indices,
+                    offset + y * WIN_WIDTH + tile * TEXTURE_BLOCK_SIZE, TEXTURE_BLOCK_SIZE)) {
+                    openCloseIo(1);
+                    return 0;
+                }
+            }
+            tile++;
+        }
+        y++;
+    }
+    u8 tile = first;
+    while(tile <= last) {
+        loffsets[tile] = offset;
+        tile++;
+    }
+    return 1;
+}
+
+// Frame occupancy, NULL when unknown or not loaded. Empty tiles and frames
+// are cleared instead of read.
+static const u8* occupied = NULL;
+// Frames are kept in memory as WIDTH_BLOCK_COUNT tiles of 256x256. Only the
+// tiles that intersect the viewport are read, tiled files store each tile
+// contiguously, others by rows, see readRows.
 static u8 readIo(u8* const frame, const u64 offset) {
-    static u64 loffset = -1;
-    if(offset != loffset) {
-        sceIoLseek(f, offset, SEEK_SET);
-        const u64 nbytes = WIN_PIXELS_COUNT * sizeof(u8);
-        if(nbytes != sceIoRead(f, frame, nbytes)) {
-            openCloseIo(1);
-            return 0;
+    u8 updated = 0;
+    u8 start = LAST_TILE + 1;
+    u8 end = 0;
+    u8 tile = FIRST_TILE;
+    while(tile <= LAST_TILE) {
+        if(offset != loffsets[tile]) {
+            u8* const indices = &frame[tile * TILE_INDICES_COUNT];
+            if(offset == EMPTY_OFFSET ||
+                (occupied != NULL && isSpanEmpty(occupied, tile * TEXTURE_BLOCK_SIZE, TEXTURE_BLOCK_SIZE))) {
+                memset(indices, 0, TILE_INDICES_COUNT);
+            } else if(TILED || WIDTH_BLOCK_COUNT == 1) {
+                if(TILE_INDICES_COUNT != readShards(indices, offset + tile * TILE_INDICES_COUNT,
+                    TILE_INDICES_COUNT)) {
+                    openCloseIo(1);
+                    return 0;
+                }
+            } else {
+                start = tile < start ? tile : start;
+                end = tile;
+                tile++;
+                continue;
+            }
+            loffsets[tile] = offset;
+            updated = 1;
         }
-        loffset = offset;
-        return 1;
+        tile++;
     }
-    return 0;
+    if(start <= end) {
+        return readRows(frame, offset, start, end);
+    }
+    return updated;
 }
 
 void updateView(u8* const frame, u8* const base) {
+    const u32 first = FIRST_TILE * TILE_INDICES_COUNT;
     sceKernelDcacheWritebackAll();
-    sceDmacMemcpy(base, frame, FRAME_INDICES_COUNT);
+    sceDmacMemcpy(&base[first], &frame[first], (LAST_TILE - FIRST_TILE + 1) * TILE_INDICES_COUNT);
 }
 
 static int ajustCursor(const int value, const u8 mode) {
@@ -156,16 +346,23 @@ static int ajustCursor(const int value, const u8 mode) {
 }
 
 static u64 getOffset(const int move, const int hrotate, const int vrotate) {
-    return FRAME_INDICES_COUNT * move + (hrotate * VERTICAL_POV_COUNT + vrotate) * SPACE_INDICES_COUNT;
+    return getSlotOffset(getFrameIndex(hrotate * VERTICAL_POV_COUNT + vrotate, move), 0, FRAME_INDICES_COUNT);
 }
 
+// Number of frames a navigation button has been held, picks the LOD level
+#define LOD_HOLD_FRAMES 6
+static u16 held = 0;
+
 SceCtrlData pad;
 static u64 controls() {
     static int move = 0;
     static int hrotate = 0;
     static int vrotate = 0;
     
-    sceCtrlReadBufferPositive(&pad, 1);
+    if(!replayPad(&pad)) {
+        latchPad(&pad);
+        recordPad(&pad);
+    }
     
     if(pad.Buttons & PSP_CTRL_TRIANGLE) { move++; }
     if(pad.Buttons & PSP_CTRL_CROSS) { move--; }
@@ -174,10 +371,24 @@ static u64 controls() {
     if(pad.Buttons & PSP_CTRL_UP) { vrotate--; }
     if(pad.Buttons & PSP_CTRL_DOWN) { vrotate++; }
     
+    if(pad.Buttons & (PSP_CTRL_TRIANGLE | PSP_CTRL_CROSS | PSP_CTRL_RIGHT |
+        PSP_CTRL_LEFT | PSP_CTRL_UP | PSP_CTRL_DOWN)) {
+        held = held < 0xFFFF ? held + 1 : held;
+    } else held = 0;
+    
     move = ajustCursor(move, 0);
     hrotate = ajustCursor(hrotate, 1);
     vrotate = ajustCursor(vrotate, 2);
     
+    if(TEXTURE_WIDTH > SCREEN_WIDTH) {
+        const u16 x = VIEW_X;
+        if((pad.Buttons & PSP_CTRL_LTRIGGER) && VIEW_X >= P) { VIEW_X -= P; }
+        if((pad.Buttons & PSP_CTRL_RTRIGGER) && VIEW_X + SCREEN_WIDTH + P <= TEXTURE_WIDTH) { VIEW_X += P; }
+        if(x != VIEW_X) {
+            generateRenderSurface();
+        }
+    }
+    
     return getOffset(move, hrotate, vrotate);
 }
 
@@ -196,16 +407,23 @@ u8 getPower(u16 value) {
 void getOptions() {
     FILE* f = fopen("options.txt", "r");
     if(f != NULL) {
-        char* options = (char*)memalign(16, 128);
-        fgets(options, 128, f);
+        char options[128];
+        fgets(options, sizeof(options), f);
         sscanf(options, "HPOV:%u VPOV:%u RAYSTEP:%u WBCOUNT:%u DBCOUNT:%u",
             &HORIZONTAL_POV_COUNT,
             &VERTICAL_POV_COUNT,
             &RAY_STEP,
             &WIDTH_BLOCK_COUNT,
             &DEPTH_BLOCK_COUNT);
+        TILED = strstr(options, "TILED:1") != NULL;
+        LATE_LATCH = strstr(options, "LATCH:1") != NULL;
+        ON_CHANGE = strstr(options, "ONCHANGE:1") != NULL;
+        HUD = strstr(options, "HUD:0") == NULL;
+        getLayoutSettings(options);
+        getBlockSettings(options);
+        getProbeSettings(options);
+        getReplaySettings(options);
         fclose(f);
-        free(options);
     }
     
     f = fopen("clut.bin", "rb");
@@ -216,67 +434,168 @@ void getOptions() {
 }
 
 int main() {
+    profileStep("start");
     scePowerSetClockFrequency(333, 333, 166);    
     getOptions();
+    profileStep("options");
     
     WIN_WIDTH = SPACE_BLOCK_SIZE * WIDTH_BLOCK_COUNT;
     WIN_PIXELS_COUNT = WIN_WIDTH * WIN_HEIGHT;
     FRAME_INDICES_COUNT = WIN_PIXELS_COUNT * sizeof(u8);
-    SPACE_INDICES_COUNT = ((DEPTH_BLOCK_COUNT * SPACE_BLOCK_SIZE) / RAY_STEP) * FRAME_INDICES_COUNT;    
+    setLayout(HORIZONTAL_POV_COUNT * VERTICAL_POV_COUNT, (DEPTH_BLOCK_COUNT * SPACE_BLOCK_SIZE) / RAY_STEP);
     TEXTURE_WIDTH = TEXTURE_BLOCK_SIZE * WIDTH_BLOCK_COUNT;
-
-    u8* base = memalign(16, FRAME_INDICES_COUNT);
-    u8* frame = memalign(16, FRAME_INDICES_COUNT);
-    void* list = memalign(16, 262144);
+    TILE_INDICES_COUNT = TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE;
+    
+    openLods();
+    
+    // Every buffer lives in one arena sized from the options, the reduced
+    // frames are planned last so they are the first dropped on a full heap
+    u8* base;
+    u8* frame;
+    void* list;
+    planBuffer("list", &list, 1024, 0);
+    planBuffer("frame", &frame, FRAME_INDICES_COUNT, 0);
+    planBuffer("base", &base, FRAME_INDICES_COUNT, 0);
+    planBuffer("offsets", &loffsets, WIDTH_BLOCK_COUNT * sizeof(u64), 0);
+    planBuffer("surface", &surface, getSurfaceBytes(), 0);
+    planBuffer("draw lists", &drawLists, LOD_LEVELS_COUNT * DRAW_LIST_BYTES_COUNT, 0);
+    u32 stored;
+    const u32 dedupBytes = openDedup(HORIZONTAL_POV_COUNT * VERTICAL_POV_COUNT *
+        ((DEPTH_BLOCK_COUNT * SPACE_BLOCK_SIZE) / RAY_STEP), &stored);
+    if(dedupBytes) {
+        planBuffer("frame slots", &frameSlots, dedupBytes, 0);
+    }
+    const u32 occupancyBytes = openOccupancy(WIN_WIDTH, WIN_HEIGHT, stored);
+    if(occupancyBytes) {
+        planBuffer("occupancy", &occupancy, occupancyBytes, 1);
+    }
+    if(!TILED && WIDTH_BLOCK_COUNT > 1) {
+        planBuffer("rows", &rows, FRAME_INDICES_COUNT, 1);
+    }
+    planBlocks();
+    planProbe(WIN_PIXELS_COUNT, WIDTH_BLOCK_COUNT, 0);
+    planHud();
+    u8 level = 1;
+    while(level < LOD_COUNT) {
+        planBuffer("lod frame", &lodFrames[level], FRAME_INDICES_COUNT >> (level * 2), 1);
+        planBuffer("lod offsets", &lodOffsets[level], WIDTH_BLOCK_COUNT * sizeof(u64), 1);
+        planBuffer("lod surface", &lodSurfaces[level], getSurfaceBytes(), 1);
+        level++;
+    }
+    const u32 frames = openReplay();
+    if(frames) {
+        planBuffer("replay times", &replayTimes, frames * sizeof(u32), 0);
+    }
+    requireArena("memory.txt");
+    loadDedup();
+    loadOccupancy();
+    buildHudAtlas();
+    
+    // Reduced levels missing a buffer are not shown
+    level = 1;
+    while(level < LOD_COUNT && lodFrames[level] && lodOffsets[level] && lodSurfaces[level]) {
+        memset(lodOffsets[level], 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+        level++;
+    }
+    closeLods(level);
+    memset(loffsets, 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+    profileStep("buffers");
     
     generateRenderSurface();
+    profileStep("lod and surface");
     
     sceGuInit();
     initGuContext(list);
     pspDebugScreenInitEx(NULL, PSP_DISPLAY_PIXEL_FORMAT_8888, 0);
     pspDebugScreenEnableBackColor(0);
+    profileStep("gu");
     
     openCloseIo(1);
+    profileStep("open");
+    
+    if(PROBE) {
+        runProbe(0, (u64)stored * FRAME_INDICES_COUNT, VERTICAL_POV_COUNT);
+        profileStep("probe");
+    }
     
     int dbuff = 0;
     u64 prev, now, fps = 0;
+    u32 frameUs = 0;
+    u64 loffset = -1;
+    u32 lview = -1;
     const u64 tickResolution = sceRtcGetTickResolution();
 
     do {
         sceRtcGetCurrentTick(&prev);
+        latencyWait();
+        
+        const u64 offset = controls();
         
+        // Reduced frames are shown as is while moving fast, the full frame
+        // is read again once input settles
+        u8 lod = held >= LOD_HOLD_FRAMES * 4 ? 2 : (held >= LOD_HOLD_FRAMES ? 1 : 0);
+        lod = lod < LOD_COUNT ? lod : LOD_COUNT - 1;
+        
+        // The displayed buffer is kept as long as the view does not change
+        const u32 view = lod | VIEW_X << 2;
+        if(ON_CHANGE && offset == loffset && view == lview) {
+            latencyIdle();
+            replayVblank();
+            latencyVblank();
+            replayFrameDone();
+            continue;
+        }
+        loffset = offset;
+        lview = view;
+        occupied = offset == EMPTY_OFFSET ? NULL : getOccupancy(offset / FRAME_INDICES_COUNT);
+        
+        if(!LISTS_READY) {
+            buildDrawLists(base);
+        }
         sceGuStart(GU_DIRECT, list);
         sceGuClear(GU_COLOR_BUFFER_BIT);
         
-        if(readIo(frame, controls())) {
+        if(lod) {
+            readLod(offset, lod);
+        } else if(readIo(frame, offset)) {
             updateView(frame, base);
         }
         
-        sceGuTexImage(0, TEXTURE_WIDTH, TEXTURE_BLOCK_SIZE, TEXTURE_WIDTH, base);        
-        sceGumDrawArray(GU_SPRITES, GU_TEXTURE_16BIT|GU_TRANSFORM_2D|GU_VERTEX_16BIT,
-        VERTICES_COUNT, 0, surface);
+        sceGuCallList(&drawLists[lod * DRAW_LIST_BYTES_COUNT]);
+        
+        hudPrintf("Fps: %llu, frame: %u us, HUD: %u us\n", fps, frameUs, getHudUs());
+        hudPrintf("Startup: %u ms, memory: %u KB\n", getStartupMs(), arenaSize / 1024);
+        printLatency();
+        printBlocks();
+        printProbe();
+        drawHud();
         
         sceGuFinish();
         sceGuSync(GU_SYNC_FINISH, GU_SYNC_WHAT_DONE);
+        printHud(dbuff);
         
-        pspDebugScreenSetOffset(dbuff);
-        pspDebugScreenSetXY(0, 0);
-        pspDebugScreenSetTextColor(0xFF00A0FF);
-        pspDebugScreenPrintf("Fps: %llu\n", fps);
-        
-        sceDisplayWaitVblankStart(); 
+        latencyWorkDone();
+        replayVblank();
+        latencyVblank();
         dbuff = (int)sceGuSwapBuffers();
+        latencySwap();
+        profileFirstFrame("startup.txt");
         
         sceRtcGetCurrentTick(&now);
         fps = tickResolution / (now - prev);
+        frameUs = ((now - prev) * 1000000) / tickResolution;
+        replayFrameDone();
     } while(!(pad.Buttons & PSP_CTRL_SELECT));
     
-    sceGuTerm();
-    free(surface);
-    free(list);
-    free(base);
-    free(frame);
+    writeLatency("latency.txt");
+    writeBlocks("io.txt");
+    writeProbe("probe.txt");
+    writeHud("hud.txt");
+    closeReplay("replay.txt");
     
+    sceGuTerm();
+    freeArena();
+    closeLods(1);
     openCloseIo(0);
     sceKernelExitGame();
     return 0;
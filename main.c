@@ -13,6 +13,20 @@
 #include <psprtc.h>
 #include <psppower.h>
 #include <pspdisplay.h>
+#include "profile.h"
+#include "arena.h"
+#include "hud.h"
+#include "latency.h"
+#include "replay.h"
+#include "occupancy.h"
+#include "layout.h"
+#include "dedup.h"
+#include "dirty.h"
+#include "tune.h"
+#include "blockio.h"
+#include "shards.h"
+#include "probe.h"
+#include "quality.h"
 
 #define TEXTURE_BLOCK_SIZE 256
 #define BUFFER_WIDTH 512
@@ -27,51 +41,94 @@ void sceDmacMemcpy(void *dst, const void *src, int size);
 
 typedef struct Vertex {
 	u16 u, v;
-	u32 color;
 	u16 x, y, z;
-} Vertex __attribute__((aligned(16)));
+} Vertex;
 
 #define S TEXTURE_BLOCK_SIZE
 #define P (S / 8)
 #define T (S / 8)
 
+#define VISIBLE_TILES_COUNT 3
+#define LOD_LEVELS_COUNT 3
+
 static u16 VERTICES_COUNT;
 static u16 TEXTURE_WIDTH;
 static Vertex* quad;
+static Vertex* lodQuads[LOD_LEVELS_COUNT];
+static u8 LOD_COUNT = 1;
+
+// Horizontal viewport over the texture tiles, panned with L/R
+static u16 VIEW_X = 0;
+static u8 FIRST_TILE;
+static u8 LAST_TILE;
+static u16 TILE_FIRST_VERTEX[VISIBLE_TILES_COUNT];
+static u16 TILE_VERTICES_COUNT[VISIBLE_TILES_COUNT];
+
+// The tiles of each level are drawn by a call list, built again once the
+// surface changes
+#define DRAW_LIST_BYTES_COUNT 256
+#define BLEND_LIST LOD_LEVELS_COUNT
+static u8* drawLists;
+static u8 LISTS_READY = 0;
+
+#define VERTICES_BY_BLOCK 2
+static u32 getSurfaceBytes() {
+    const u16 VIEW_WIDTH = TEXTURE_WIDTH < SCREEN_WIDTH ? TEXTURE_WIDTH : SCREEN_WIDTH;
+    return sizeof(Vertex) * VERTICES_BY_BLOCK * (TEXTURE_BLOCK_SIZE / P) * (VIEW_WIDTH / P);
+}
 
 void generateRenderSurface() {
-    VERTICES_COUNT = 6 * (TEXTURE_BLOCK_SIZE / P) * (TEXTURE_WIDTH / P);
-    quad = memalign(16, sizeof(Vertex) * VERTICES_COUNT);
-    const u16 X = (SCREEN_WIDTH - TEXTURE_WIDTH) / 2;
+    const u16 VIEW_WIDTH = TEXTURE_WIDTH < SCREEN_WIDTH ? TEXTURE_WIDTH : SCREEN_WIDTH;
+    const u16 X = (SCREEN_WIDTH - VIEW_WIDTH) / 2;
     const u16 Y = (SCREEN_HEIGHT - TEXTURE_BLOCK_SIZE) / 2;
-    u16 x = 0;
+    FIRST_TILE = VIEW_X / TEXTURE_BLOCK_SIZE;
+    LAST_TILE = (VIEW_X + VIEW_WIDTH - 1) / TEXTURE_BLOCK_SIZE;
+    u16 x = VIEW_X;
     u16 offset = 0;
-    while(x < TEXTURE_WIDTH) {
+    while(x < VIEW_X + VIEW_WIDTH) {
+        const u8 slot = x / TEXTURE_BLOCK_SIZE - FIRST_TILE;
+        const u16 u = x % TEXTURE_BLOCK_SIZE;
+        const u16 sx = X + x - VIEW_X;
+        if(x == VIEW_X || !u) {
+            TILE_FIRST_VERTEX[slot] = offset;
+        }
         u16 y = 0;
         while(y < TEXTURE_BLOCK_SIZE) {
-            const Vertex a = {x,   y+T, 0xFFFFFFFF, X+x,   Y+y+P, 0};
-            const Vertex b = {x,   y,   0xFFFFFFFF, X+x,   Y+y,   0};
-            const Vertex c = {x+T, y,   0xFFFFFFFF, X+x+P, Y+y,   0};
-            const Vertex d = {x+T, y,   0xFFFFFFFF, X+x+P, Y+y,   0};
-            const Vertex e = {x+T, y+T, 0xFFFFFFFF, X+x+P, Y+y+P, 0};
-            const Vertex f = {x,   y+T, 0xFFFFFFFF, X+x,   Y+y+P, 0};
-            
+            const Vertex a = {u,   y,   sx,   Y+y,   0};
+            const Vertex b = {u+T, y+T, sx+P, Y+y+P, 0};
             quad[offset + 0] = a;
             quad[offset + 1] = b;
-            quad[offset + 2] = c;
-            quad[offset + 3] = d;
-            quad[offset + 4] = e;
-            quad[offset + 5] = f;
-            
-            offset += 6;
+            offset += VERTICES_BY_BLOCK;
             y += P;
         }
+        TILE_VERTICES_COUNT[slot] = offset - TILE_FIRST_VERTEX[slot];
         x += P;
     }
+    VERTICES_COUNT = offset;
+    sceKernelDcacheWritebackRange(quad, sizeof(Vertex) * VERTICES_COUNT);
+    
+    // Same surface sampling the reduced frames, upscaled by the GE
+    u8 level = 1;
+    while(level < LOD_COUNT) {
+        Vertex* const lquad = lodQuads[level];
+        u16 i = VERTICES_COUNT;
+        while(i--) {
+            lquad[i] = quad[i];
+            lquad[i].u >>= level;
+            lquad[i].v >>= level;
+        }
+        sceKernelDcacheWritebackRange(lquad, sizeof(Vertex) * VERTICES_COUNT);
+        level++;
+    }
+    LISTS_READY = 0;
 }
 
 #define SPACE_BLOCK_SIZE 256
 static u8 DEPTH_OF_FIELD = 0;
+static u8 DOF_SELECTED = 0;
+// DOF:0 leaves the DOF tables out of the arena, SQUARE then does nothing
+static u8 DOF_AVAILABLE = 1;
+static u8 ON_CHANGE = 0;
 static u32 HEADER_SIZE = 0;
 static u32 WIDTH_BLOCK_COUNT = 1;
 static u32 DEPTH_BLOCK_COUNT = 1;
@@ -80,14 +137,22 @@ static u32 HORIZONTAL_POV_COUNT = 4;
 static u32 VERTICAL_POV_COUNT = 1;
 static float MAX_PROJECTION_DEPTH = 0.0f;
 static float PROJECTION_FACTOR;
-static u8 SPACE_Y_OFFSET;
 static u16 WIN_WIDTH;
 static u16 WIN_HEIGHT = SPACE_BLOCK_SIZE;
 static u16 WIN_WIDTH_D2;
 static u16 WIN_HEIGHT_D2;
 static u32 WIN_PIXELS_COUNT;
 static u32 FRAME_BYTES_COUNT;
-static u32 SPACE_BYTES_COUNT;
+static u8 TILED = 0;
+static u32 TILE_PIXELS_COUNT;
+static u32 TILE_BYTES_COUNT;
+
+// Frames are kept in memory as WIDTH_BLOCK_COUNT tiles of 256x256, so each
+// tile is a contiguous texture and a contiguous read in a tiled file
+static inline u32 getTexel(const u32 x, const u32 y) {
+    return (x % TEXTURE_BLOCK_SIZE) + y * TEXTURE_BLOCK_SIZE +
+        (x / TEXTURE_BLOCK_SIZE) * TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE;
+}
 
 // Pre-calculation Processes
 typedef struct {
@@ -107,46 +172,50 @@ static u32* frame;
 static float* _DOF;
 static DofMatRef* _DOF_MATRIX_REFS;
 
-void preCalcDof() {    
-    _DOF_MATRIX_REFS = memalign(16, WIN_PIXELS_COUNT * sizeof(DofMatRef));
+// The DOF tables are built on demand, a few rows at a time while the view
+// is idle, and completed the first time DOF is enabled. They are left out
+// when the arena cannot hold them.
+static u16 DOF_ROWS_READY = 0;
+void preCalcDof(u16 rows) {
+    if(DOF_ROWS_READY == WIN_HEIGHT || _DOF_MATRIX_REFS == NULL || _DOF == NULL) {
+        return;
+    }
+    if(!DOF_ROWS_READY) {
+        u16 depth = 256;
+        const float maxdof = 127.0f;
+        while(depth--) {
+            if(depth >= maxdof) {
+                _DOF[depth] = 0;
+            } else {
+                _DOF[depth] = (maxdof - depth)/maxdof;
+            }
+        }
+    }
     
     const u8 size = 3;
-    u32 x = WIN_WIDTH;
-    while(x--) {
-        u32 y = WIN_HEIGHT;
-        while(y--) {
+    while(rows-- && DOF_ROWS_READY < WIN_HEIGHT) {
+        const u32 y = DOF_ROWS_READY++;
+        u32 x = WIN_WIDTH;
+        while(x--) {
             int xr = x + size >= WIN_WIDTH ? 0 : size;
             int xl = x - size < 0 ? 0 : -size;
             int yd = y + size >= WIN_HEIGHT ? 0 : size;
             int yu = y - size < 0 ? 0 : -size;
-            DofMatRef* const m = &_DOF_MATRIX_REFS[x | y << SPACE_Y_OFFSET];
-            m->o = &frame[x | y << SPACE_Y_OFFSET];
-            m->a = &frame[(x + xr - 1) | y << SPACE_Y_OFFSET];
-            m->b = &frame[(x + xl + 1) | y << SPACE_Y_OFFSET];
-            m->c = &frame[x | (y + yd - 1) << SPACE_Y_OFFSET];
-            m->d = &frame[x | (y + yu + 1) << SPACE_Y_OFFSET];
-            m->e = &frame[(x + xr) | (y + yd) << SPACE_Y_OFFSET];
-            m->f = &frame[(x + xl) | (y + yd) << SPACE_Y_OFFSET];
-            m->g = &frame[(x + xr) | (y + yu) << SPACE_Y_OFFSET];
-            m->h = &frame[(x + xl) | (y + yu) << SPACE_Y_OFFSET];
-        }
-    }
-    
-    _DOF = memalign(16, 256 * sizeof(float));
-    u16 depth = 256;
-    const float maxdof = 127.0f;
-    while(depth--) {
-        if(depth >= maxdof) {
-            _DOF[depth] = 0;
-        } else {
-            _DOF[depth] = (maxdof - depth)/maxdof;
+            DofMatRef* const m = &_DOF_MATRIX_REFS[getTexel(x, y)];
+            m->o = &frame[getTexel(x, y)];
+            m->a = &frame[getTexel(x + xr - 1, y)];
+            m->b = &frame[getTexel(x + xl + 1, y)];
+            m->c = &frame[getTexel(x, y + yd - 1)];
+            m->d = &frame[getTexel(x, y + yu + 1)];
+            m->e = &frame[getTexel(x + xr, y + yd)];
+            m->f = &frame[getTexel(x + xl, y + yd)];
+            m->g = &frame[getTexel(x + xr, y + yu)];
+            m->h = &frame[getTexel(x + xl, y + yu)];
         }
     }
 }
+
 void preCalculate() {
-    _FACTORS = memalign(16, 256 * sizeof(float));
-    _COORDINATES = memalign(16, WIN_PIXELS_COUNT * sizeof(Coords));
-    
     u16 depth = 256;
     while(depth--) {
         _FACTORS[depth] = 1.0f - ((float)depth * PROJECTION_FACTOR);
@@ -156,7 +225,7 @@ void preCalculate() {
     while(ux--) {
         u16 uy = WIN_HEIGHT;
         while(uy--) {
-            const u32 i = ux + uy * WIN_WIDTH;
+            const u32 i = getTexel(ux, uy);
             _COORDINATES[i].x = ux - WIN_WIDTH_D2;
             _COORDINATES[i].y = uy - WIN_HEIGHT_D2;
         }
@@ -187,41 +256,209 @@ static void initGuContext(void* list) {
     sceGuSync(GU_SYNC_FINISH, GU_SYNC_WHAT_DONE);
 }
 
-static SceUID f;
 static void openCloseIo(const u8 open) {
     if(open) {
-        f = sceIoOpen("atoms.apov", PSP_O_RDONLY, 0777);
-    } else sceIoClose(f);
+        openShards("atoms.apov");
+    } else closeShards();
 }
 
+// Optional half and quarter resolution captures, stored as tiles, shown
+// while a direction is held
+static const char* const LOD_FILES[LOD_LEVELS_COUNT] = {
+    NULL, "atoms-lod1.apov", "atoms-lod2.apov"
+};
+static SceUID lods[LOD_LEVELS_COUNT];
+static u32* lodFrames[LOD_LEVELS_COUNT];
+static u64* lodOffsets[LOD_LEVELS_COUNT];
+static void openLods() {
+    while(LOD_COUNT < LOD_LEVELS_COUNT &&
+        (lods[LOD_COUNT] = sceIoOpen(LOD_FILES[LOD_COUNT], PSP_O_RDONLY, 0777)) >= 0) {
+        LOD_COUNT++;
+    }
+}
+static void closeLods(const u8 count) {
+    while(LOD_COUNT > count) {
+        sceIoClose(lods[--LOD_COUNT]);
+    }
+}
 
-static void readIo(u32* const frame, const u64 offset) {
-    static u64 loffset = -1;
-    if(offset != loffset) {
-        sceIoLseek(f, offset, SEEK_SET);
-        const u64 nbytes = WIN_PIXELS_COUNT * sizeof(u32);
-        if(nbytes != sceIoRead(f, frame, nbytes)) {
-            openCloseIo(1);
+static void readLod(const u64 offset, const u8 level) {
+    const u32 nbytes = TILE_BYTES_COUNT >> (level * 2);
+    const u64 loffset = offset == EMPTY_OFFSET ? EMPTY_OFFSET : ((offset - HEADER_SIZE) >> (level * 2));
+    u8 tile = FIRST_TILE;
+    while(tile <= LAST_TILE) {
+        if(loffset == EMPTY_OFFSET && loffset != lodOffsets[level][tile]) {
+            memset((u8*)lodFrames[level] + tile * nbytes, 0, nbytes);
+            lodOffsets[level][tile] = loffset;
+        } else if(loffset != lodOffsets[level][tile]) {
+            sceIoLseek(lods[level], loffset + tile * nbytes, SEEK_SET);
+            if(nbytes != sceIoRead(lods[level], (u8*)lodFrames[level] + tile * nbytes, nbytes)) {
+                lodOffsets[level][tile] = -1;
+            } else lodOffsets[level][tile] = loffset;
         }
-        loffset = offset;
+        tile++;
     }
 }
 
-void getView(u32* const frame, u8* const zpos, u32* const base) {
-    if(MAX_PROJECTION_DEPTH > 0.0f) {
-        u32 i = WIN_PIXELS_COUNT;
-        while(i--) {
-            const u32 _frame = frame[i];
-            const u8 depth = (u8)(_frame & 0x000000FF);
-            if(_frame) {
-                const float s = _FACTORS[depth];
-                const int _x = _COORDINATES[i].x * s;
-                const int _y = _COORDINATES[i].y * s;
-            
-                if(_x >= -WIN_WIDTH_D2 && _x < WIN_WIDTH_D2 && _y >= -WIN_HEIGHT_D2 && _y < WIN_HEIGHT_D2) {
-                    const u16 __x = (_x + WIN_WIDTH_D2 - 2);
-                    const u16 __y = (_y + WIN_HEIGHT_D2 - 2);
-                    const u32 offset = __x | (__y << 8);                    
+// With BLEND:1 the depth moves by 1/RAY_STEP of a slice. Between two slices
+// the next one is kept in its own texture, drawn over the shown one by the
+// GE with a fixed alpha of the fraction. The next slice is not composed,
+// with DOF the shown slice stays whole instead.
+static u8 BLEND = 0;
+static u8 DEPTH_PHASE = 0;
+static u32* next = NULL;
+static u64* noffsets = NULL;
+static u64 nextOffset;
+
+static void buildDrawList(u8* const drawList, u32* const texture, Vertex* const surface, const u8 level) {
+    const u16 width = TEXTURE_BLOCK_SIZE >> level;
+    sceKernelDcacheWritebackInvalidateRange(drawList, DRAW_LIST_BYTES_COUNT);
+    sceGuStart(GU_CALL, drawList);
+    sceGuTexMode(GU_PSM_8888, 0, 1, 0);
+    sceGuTexFunc(GU_TFX_REPLACE, GU_TCC_RGB);
+    sceGuTexFilter(level ? GU_LINEAR : GU_NEAREST, level ? GU_LINEAR : GU_NEAREST);
+    u8 tile = FIRST_TILE;
+    while(tile <= LAST_TILE) {
+        const u8 slot = tile - FIRST_TILE;
+        sceGuTexImage(0, width, width, width, &texture[tile * (TILE_PIXELS_COUNT >> (level * 2))]);
+        sceGuDrawArray(GU_SPRITES, GU_TEXTURE_16BIT|GU_TRANSFORM_2D|GU_VERTEX_16BIT,
+        TILE_VERTICES_COUNT[slot], 0, &surface[TILE_FIRST_VERTEX[slot]]);
+        tile++;
+    }
+    sceGuFinish();
+}
+
+// Records the texture and draw commands of the visible tiles once per level,
+// the frame list only clears and calls the list of the shown level. The
+// next slice has its own list, called with the blending set by the frame.
+static void buildDrawLists(u32* const base) {
+    u8 level = 0;
+    while(level < LOD_COUNT) {
+        buildDrawList(&drawLists[level * DRAW_LIST_BYTES_COUNT], level ? lodFrames[level] : base,
+            level ? lodQuads[level] : quad, level);
+        level++;
+    }
+    if(next != NULL) {
+        buildDrawList(&drawLists[BLEND_LIST * DRAW_LIST_BYTES_COUNT], next, quad, 0);
+    }
+    LISTS_READY = 1;
+}
+
+
+// Frame occupancy, NULL when unknown or not loaded
+static const u8* occupied = NULL;
+static const u8* getFrameOccupancy(const u64 offset) {
+    return offset == EMPTY_OFFSET ? NULL : getOccupancy((offset - HEADER_SIZE) / FRAME_BYTES_COUNT);
+}
+
+// Untiled wide frames are read as the rows spanning the tiles first to last
+// in one call, then scattered to the tiles not held yet. Without the buffer
+// the rows are read in file order across the tiles, so the read window
+// loads each of them once.
+static u32* rows = NULL;
+static void readRows(u32* const frame, const u64 offset, const u8 first, const u8 last, u64* const offsets) {
+    const u32 nbytes = TEXTURE_BLOCK_SIZE * sizeof(u32);
+    const u32 span = (TEXTURE_BLOCK_SIZE - 1) * WIN_WIDTH * sizeof(u32) + (last - first + 1) * nbytes;
+    if(rows != NULL && span != readShards(rows, offset + first * nbytes, span)) {
+        openCloseIo(1);
+    }
+    u16 y = 0;
+    while(y < TEXTURE_BLOCK_SIZE) {
+        u8 tile = first;
+        while(tile <= last) {
+            if(offset != offsets[tile]) {
+                u32* const texels = &frame[tile * TILE_PIXELS_COUNT + y * TEXTURE_BLOCK_SIZE];
+                if(rows != NULL) {
+                    memcpy(texels, &rows[y * WIN_WIDTH + (tile - first) * TEXTURE_BLOCK_SIZE], nbytes);
+                } else if(nbytes != readShards(texels, offset + (y * WIN_WIDTH + tile * TEXTURE_BLOCK_SIZE) *
+                    sizeof(u32), nbytes)) {
+                    openCloseIo(1);
+                    y = TEXTURE_BLOCK_SIZE;
+                    break;
+                }
+            }
+            tile++;
+        }
+        y++;
+    }
+    u8 tile = first;
+    while(tile <= last) {
+        offsets[tile] = offset;
+        tile++;
+    }
+}
+
+// Reads the tiles of the frame that intersect the viewport, offsets holds
+// the frame in each tile of the buffer. Tiled files store each tile
+// contiguously, others by rows, see readRows. Empty tiles and frames are
+// cleared instead.
+static u64* loffsets;
+static void readIo(u32* const frame, const u64 offset, const u8 first, const u8 last, u64* const offsets) {
+    u8 start = last + 1;
+    u8 end = 0;
+    u8 tile = first;
+    while(tile <= last) {
+        if(offset != offsets[tile]) {
+            u32* const texels = &frame[tile * TILE_PIXELS_COUNT];
+            if(offset == EMPTY_OFFSET ||
+                (occupied != NULL && isSpanEmpty(occupied, tile * TEXTURE_BLOCK_SIZE, TEXTURE_BLOCK_SIZE))) {
+                memset(texels, 0, TILE_BYTES_COUNT);
+            } else if(TILED || WIDTH_BLOCK_COUNT == 1) {
+                if(TILE_BYTES_COUNT != readShards(texels, offset + tile * TILE_BYTES_COUNT, TILE_BYTES_COUNT)) {
+                    openCloseIo(1);
+                }
+            } else {
+                start = tile < start ? tile : start;
+                end = tile;
+                tile++;
+                continue;
+            }
+            offsets[tile] = offset;
+        }
+        tile++;
+    }
+    if(start <= end) {
+        readRows(frame, offset, start, end, offsets);
+    }
+}
+
+// Crossing a slice boundary copies the slice held by one buffer to the other
+// instead of reading it again
+static void keepSlices(u32* const current, const u64 offset, const u64 noffset) {
+    u8 tile = FIRST_TILE;
+    while(tile <= LAST_TILE) {
+        u32* const c = &current[tile * TILE_PIXELS_COUNT];
+        u32* const n = &next[tile * TILE_PIXELS_COUNT];
+        if(noffset != offset && noffsets[tile] != noffset && loffsets[tile] == noffset) {
+            memcpy(n, c, TILE_BYTES_COUNT);
+            noffsets[tile] = noffset;
+        }
+        if(loffsets[tile] != offset && noffsets[tile] == offset) {
+            memcpy(c, n, TILE_BYTES_COUNT);
+            loffsets[tile] = offset;
+        }
+        tile++;
+    }
+}
+
+static u8 getDepthSteps() {
+    return next != NULL && noffsets != NULL ? RAY_STEP : 1;
+}
+
+static void projectSpan(u32* const frame, u8* const zpos, u32* const base, u32 i, u32 count) {
+    while(count--) {
+        const u32 _frame = frame[i];
+        const u8 depth = (u8)(_frame & 0x000000FF);
+        if(_frame) {
+            const float s = _FACTORS[depth];
+            const int _x = _COORDINATES[i].x * s;
+            const int _y = _COORDINATES[i].y * s;
+        
+            if(_x >= -WIN_WIDTH_D2 && _x < WIN_WIDTH_D2 && _y >= -WIN_HEIGHT_D2 && _y < WIN_HEIGHT_D2) {
+                const u16 __x = (_x + WIN_WIDTH_D2 - 2);
+                const u16 __y = (_y + WIN_HEIGHT_D2 - 2);
+                if(__x < WIN_WIDTH && __y < WIN_HEIGHT) {
+                    const u32 offset = getTexel(__x, __y);
                     u32* const px = &base[offset];
                     
                     if(_frame && (!*px || (depth < zpos[offset]))) {
@@ -231,70 +468,255 @@ void getView(u32* const frame, u8* const zpos, u32* const base) {
                 }
             }
         }
+        i++;
+    }
+}
+
+static void dofSpan(u32* const base, u32 i, u32 count) {
+    while(count--) {
+        DofMatRef* const m = &_DOF_MATRIX_REFS[i];
+        u32 const o = *m->o;
+        u32 const a = *m->a;
+        u32 const b = *m->b;
+        u32 const c = *m->c;
+        u32 const d = *m->d;
+        u32 const e = *m->e;
+        u32 const f = *m->f;
+        u32 const g = *m->g;
+        u32 const h = *m->h;
+        
+        if(o || a || b || c || d || e || f || g || h) {
+            const u8 n =
+                (a ? 1 : 0) + (b ? 1 : 0) + (c ? 1 : 0) +
+                (d ? 1 : 0) + (e ? 1 : 0) + (f ? 1 : 0) +
+                (g ? 1 : 0) + (h ? 1 : 0);
+            
+            const int dd = n ? ((
+                (a >> 24) + (b >> 24) + (c >> 24) +
+                (d >> 24) + (e >> 24) + (f >> 24) +
+                (g >> 24) + (h >> 24)
+            ) / n) - (o >> 24) : 0;
+            
+            if(dd >= -10 && dd <= 10) {
+                const u8 _R = (
+                    (o & 0x000000FF) + (a & 0x000000FF) + (b & 0x000000FF) +
+                    (c & 0x000000FF) + (d & 0x000000FF) + (e & 0x000000FF) +
+                    (f & 0x000000FF) + (g & 0x000000FF) + (h & 0x000000FF)) / 9;
+                const u8 _G = (
+                    ((o & 0x0000FF00) >> 8) + ((a & 0x0000FF00) >> 8) + ((b & 0x0000FF00) >> 8) +
+                    ((c & 0x0000FF00) >> 8) + ((d & 0x0000FF00) >> 8) + ((e & 0x0000FF00) >> 8) +
+                    ((f & 0x0000FF00) >> 8) + ((g & 0x0000FF00) >> 8) + ((h & 0x0000FF00) >> 8)) / 9;
+                const u8 _B = (
+                    ((o & 0x00FF0000) >> 16) + ((a & 0x00FF0000) >> 16) + ((b & 0x00FF0000) >> 16) +
+                    ((c & 0x00FF0000) >> 16) + ((d & 0x00FF0000) >> 16) + ((e & 0x00FF0000) >> 16) +
+                    ((f & 0x00FF0000) >> 16) + ((g & 0x00FF0000) >> 16) + ((h & 0x00FF0000) >> 16)) / 9;
+                
+                const float m = _DOF[o >> 24];
+                const u8 R = m * (o & 0x000000FF) +  (1 - m) * _R;
+                const u8 G = m * ((o & 0x0000FF00) >> 8) + (1 - m) * _G;
+                const u8 B = m * ((o & 0x00FF0000) >> 16) + (1 - m) * _B;
+                
+                base[i] = 0xFF000000 | (B << 16) | (G << 8) | R;
+            } else base[i] = 0xFF000000 | o;
+        }
+        i++;
+    }
+}
+
+// Tiles are split in bands of DIRTY_ROWS rows, contiguous in the frame and
+// in base. Only the changed bands are composed when tracking is on.
+#define TILE_BANDS_COUNT (TEXTURE_BLOCK_SIZE / DIRTY_ROWS)
+#define BAND_PIXELS_COUNT (DIRTY_ROWS * TEXTURE_BLOCK_SIZE)
+
+// Hashes the bands of the tiles read for the viewport, the other tiles are
+// stale and composed again once visible
+static void markBands(const u32* const frame) {
+    if(!isTracking()) {
+        return;
+    }
+    u32 band = 0;
+    while(band < BANDS_COUNT) {
+        const u8 tile = band / TILE_BANDS_COUNT;
+        if(tile >= FIRST_TILE && tile <= LAST_TILE) {
+            updateBand(band, hashWords(&frame[band * BAND_PIXELS_COUNT], BAND_PIXELS_COUNT, 5381));
+        } else bandHashes[band] = 0;
+        band++;
+    }
+}
+
+// DOF reads 3 texels around each one, so the 8 bands around a changed one
+// are composed again too, the diagonal ones for its corners
+static u8 isBandDirty(const u32 band) {
+    if(isBandChanged(band)) {
+        return 1;
+    }
+    if(!DEPTH_OF_FIELD) {
+        return 0;
+    }
+    const u8 tile = band / TILE_BANDS_COUNT;
+    const u32 row = band % TILE_BANDS_COUNT;
+    const u8 left = tile > FIRST_TILE ? tile - 1 : tile;
+    const u8 right = tile < LAST_TILE ? tile + 1 : tile;
+    const u32 top = row ? row - 1 : row;
+    const u32 bottom = row + 1 < TILE_BANDS_COUNT ? row + 1 : row;
+    u8 t = left;
+    while(t <= right) {
+        u32 r = top;
+        while(r <= bottom) {
+            if(dirtyBands[t * TILE_BANDS_COUNT + r]) {
+                return 1;
+            }
+            r++;
+        }
+        t++;
+    }
+    return 0;
+}
+
+static u8 isTileEmpty(const u8 tile) {
+    return occupied != NULL && isSpanEmpty(occupied, tile * TEXTURE_BLOCK_SIZE, TEXTURE_BLOCK_SIZE);
+}
+
+// Only the occupied cells of a band are composed, with the cells around them
+static void dofBand(u32* const base, const u32 band) {
+    const u32 first = band * BAND_PIXELS_COUNT;
+    memset(&base[first], 0, BAND_PIXELS_COUNT * sizeof(u32));
+    if(occupied == NULL) {
+        dofSpan(base, first, BAND_PIXELS_COUNT);
+        return;
+    }
+    const u16 columns = TEXTURE_BLOCK_SIZE / OCCUPANCY_CELL;
+    const u16 cy = band % TILE_BANDS_COUNT;
+    u16 cx = (band / TILE_BANDS_COUNT) * columns;
+    const u16 last = cx + columns;
+    while(cx < last) {
+        if(isCellNear(occupied, cx, cy)) {
+            u8 y = 0;
+            while(y < OCCUPANCY_CELL) {
+                dofSpan(base, getTexel(cx * OCCUPANCY_CELL, cy * OCCUPANCY_CELL + y), OCCUPANCY_CELL);
+                y++;
+            }
+        }
+        cx++;
+    }
+}
+
+// The frame is copied to the texture by the DMA after a dcache writeback,
+// by the CPU, or read straight into the texture when nothing is composed.
+// The fastest one is picked at startup, see tune.h.
+enum {
+    COPY_DMA = 0,
+    COPY_CPU,
+    COPY_DIRECT
+};
+static u8 COPY_KERNEL = COPY_DMA;
+
+static void copyTexels(u32* const dst, const u32* const src, const u32 count) {
+    if(COPY_KERNEL == COPY_CPU) {
+        memcpy(dst, src, count * sizeof(u32));
+    } else sceDmacMemcpy(dst, src, count * sizeof(u32));
+}
+
+// Only the occupied cells are composed, DOF also reads the cells around them
+void getView(u32* const frame, u8* const zpos, u32* const base) {
+    if(MAX_PROJECTION_DEPTH > 0.0f) {
+        if(occupied == NULL) {
+            projectSpan(frame, zpos, base, 0, WIN_PIXELS_COUNT);
+            return;
+        }
+        u16 cy = 0;
+        while(cy < OCCUPANCY_ROWS) {
+            u16 cx = 0;
+            while(cx < OCCUPANCY_COLUMNS) {
+                if(isCellOccupied(occupied, cx, cy)) {
+                    u8 y = 0;
+                    while(y < OCCUPANCY_CELL) {
+                        projectSpan(frame, zpos, base, getTexel(cx * OCCUPANCY_CELL,
+                            cy * OCCUPANCY_CELL + y), OCCUPANCY_CELL);
+                        y++;
+                    }
+                }
+                cx++;
+            }
+            cy++;
+        }
     } else {
+        const u32 first = FIRST_TILE * TILE_BANDS_COUNT;
+        const u32 last = (LAST_TILE + 1) * TILE_BANDS_COUNT;
         if(DEPTH_OF_FIELD) {
-            memset(base, 0, FRAME_BYTES_COUNT);
-            u32 i = WIN_PIXELS_COUNT;
-            while(--i) {
-                DofMatRef* const m = &_DOF_MATRIX_REFS[i];
-                u32 const o = *m->o;
-                u32 const a = *m->a;
-                u32 const b = *m->b;
-                u32 const c = *m->c;
-                u32 const d = *m->d;
-                u32 const e = *m->e;
-                u32 const f = *m->f;
-                u32 const g = *m->g;
-                u32 const h = *m->h;
-                
-                if(o || a || b || c || d || e || f || g || h) {
-                    const u8 n =
-                        (a ? 1 : 0) + (b ? 1 : 0) + (c ? 1 : 0) +
-                        (d ? 1 : 0) + (e ? 1 : 0) + (f ? 1 : 0) +
-                        (g ? 1 : 0) + (h ? 1 : 0);
-                    
-                    const int dd = n ? ((
-                        (a >> 24) + (b >> 24) + (c >> 24) +
-                        (d >> 24) + (e >> 24) + (f >> 24) +
-                        (g >> 24) + (h >> 24)
-                    ) / n) - (o >> 24) : 0;
-                    
-                    if(dd >= -10 && dd <= 10) {
-                        const u8 _R = (
-                            (o & 0x000000FF) + (a & 0x000000FF) + (b & 0x000000FF) +
-                            (c & 0x000000FF) + (d & 0x000000FF) + (e & 0x000000FF) +
-                            (f & 0x000000FF) + (g & 0x000000FF) + (h & 0x000000FF)) / 9;
-                        const u8 _G = (
-                            ((o & 0x0000FF00) >> 8) + ((a & 0x0000FF00) >> 8) + ((b & 0x0000FF00) >> 8) +
-                            ((c & 0x0000FF00) >> 8) + ((d & 0x0000FF00) >> 8) + ((e & 0x0000FF00) >> 8) +
-                            ((f & 0x0000FF00) >> 8) + ((g & 0x0000FF00) >> 8) + ((h & 0x0000FF00) >> 8)) / 9;
-                        const u8 _B = (
-                            ((o & 0x00FF0000) >> 16) + ((a & 0x00FF0000) >> 16) + ((b & 0x00FF0000) >> 16) +
-                            ((c & 0x00FF0000) >> 16) + ((d & 0x00FF0000) >> 16) + ((e & 0x00FF0000) >> 16) +
-                            ((f & 0x00FF0000) >> 16) + ((g & 0x00FF0000) >> 16) + ((h & 0x00FF0000) >> 16)) / 9;
-                        
-                        const float m = _DOF[o >> 24];
-                        const u8 R = m * (o & 0x000000FF) +  (1 - m) * _R;
-                        const u8 G = m * ((o & 0x0000FF00) >> 8) + (1 - m) * _G;
-                        const u8 B = m * ((o & 0x00FF0000) >> 16) + (1 - m) * _B;
-                        
-                        base[i] = 0xFF000000 | (B << 16) | (G << 8) | R;
-                    } else base[i] = 0xFF000000 | o;
+            u32 band = first;
+            while(band < last) {
+                if(isBandDirty(band)) {
+                    dofBand(base, band);
                 }
+                band++;
             }
         } else {
-            sceKernelDcacheWritebackAll();
-            sceDmacMemcpy(base, frame, FRAME_BYTES_COUNT);
+            // Empty bands are filled, runs of the other ones copied by the
+            // tuned kernel
+            u32 band = first;
+            while(band < last) {
+                if(isBandDirty(band) && isTileEmpty(band / TILE_BANDS_COUNT)) {
+                    memset(&base[band * BAND_PIXELS_COUNT], 0, BAND_PIXELS_COUNT * sizeof(u32));
+                }
+                band++;
+            }
+            if(COPY_KERNEL == COPY_DMA) {
+                sceKernelDcacheWritebackAll();
+            }
+            band = first;
+            while(band < last) {
+                u32 end = band;
+                while(end < last && isBandDirty(end) && !isTileEmpty(end / TILE_BANDS_COUNT)) {
+                    end++;
+                }
+                if(end > band) {
+                    copyTexels(&base[band * BAND_PIXELS_COUNT], &frame[band * BAND_PIXELS_COUNT],
+                        (end - band) * BAND_PIXELS_COUNT);
+                    band = end;
+                } else band++;
+            }
+            if(COPY_KERNEL != COPY_DMA) {
+                sceKernelDcacheWritebackAll();
+            }
         }
     }
 }
 
+// The candidates read the tuning frame again from a cold window and bring
+// it to the texture with the work of the frame loop, so each one is timed
+// from the read to the texture
+static u64 tuneOffset;
+static void tuneCopy(u32* const base, const u8 kernel) {
+    COPY_KERNEL = kernel;
+    memset(loffsets, 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+    resetBlocks();
+    invalidateBands();
+    if(kernel == COPY_DIRECT) {
+        readIo(base, tuneOffset, FIRST_TILE, LAST_TILE, loffsets);
+        sceKernelDcacheWritebackAll();
+        return;
+    }
+    readIo(frame, tuneOffset, FIRST_TILE, LAST_TILE, loffsets);
+    markBands(frame);
+    getView(frame, NULL, base);
+}
+static void copyDma(void* const base) {
+    tuneCopy(base, COPY_DMA);
+}
+static void copyCpu(void* const base) {
+    tuneCopy(base, COPY_CPU);
+}
+static void readDirect(void* const base) {
+    tuneCopy(base, COPY_DIRECT);
+}
+
 static int ajustCursor(const int value, const u8 mode) {
     if(!mode) {
         u16 max;
         if(value < 0) {
             return 0;
-        } else if(value >= (max = (SPACE_BLOCK_SIZE * DEPTH_BLOCK_COUNT) / RAY_STEP)) {
+        } else if(value >= (max = ((SPACE_BLOCK_SIZE * DEPTH_BLOCK_COUNT) / RAY_STEP - 1) * getDepthSteps() + 1)) {
             return max - 1;
         }
     } else if(mode == 1) {   
@@ -314,9 +736,35 @@ static int ajustCursor(const int value, const u8 mode) {
 }
 
 static u64 getOffset(const int move, const int hrotate, const int vrotate) {
-    return HEADER_SIZE + FRAME_BYTES_COUNT * move + (hrotate * VERTICAL_POV_COUNT + vrotate) * SPACE_BYTES_COUNT;
+    return getSlotOffset(getFrameIndex(hrotate * VERTICAL_POV_COUNT + vrotate, move), HEADER_SIZE, FRAME_BYTES_COUNT);
+}
+
+// The kernels are tuned on the depth of the first POV with the most occupied
+// cells, the middle one without occupancy, as the first slices are often
+// empty
+static int getTuneMove() {
+    const int depths = (SPACE_BLOCK_SIZE * DEPTH_BLOCK_COUNT) / RAY_STEP;
+    int best = depths / 2;
+    u32 most = 0;
+    int move = 0;
+    while(move < depths) {
+        const u8* const record = getFrameOccupancy(getOffset(move, 0, 0));
+        const u32 cells = record != NULL ? getOccupiedCells(record) : 0;
+        if(cells > most) {
+            most = cells;
+            best = move;
+        }
+        move++;
+    }
+    return best;
 }
 
+// Number of frames a navigation button has been held, picks the LOD level
+#define LOD_HOLD_FRAMES 6
+#define DROP_DOF 0
+#define DROP_LOD 1
+static u16 held = 0;
+
 SceCtrlData pad;
 static u64 controls() {
     static int move = 0;
@@ -324,7 +772,10 @@ static u64 controls() {
     static int vrotate = 0;
     static SceCtrlData lpad;
     
-    sceCtrlReadBufferPositive(&pad, 1);
+    if(!replayPad(&pad)) {
+        latchPad(&pad);
+        recordPad(&pad);
+    }
     
     if(pad.Buttons & PSP_CTRL_TRIANGLE) { move++; }
     if(pad.Buttons & PSP_CTRL_CROSS) { move--; }
@@ -334,17 +785,54 @@ static u64 controls() {
     if(pad.Buttons & PSP_CTRL_UP) { vrotate--; }
     if(pad.Buttons & PSP_CTRL_DOWN) { vrotate++; }
     
+    if(pad.Buttons & (PSP_CTRL_TRIANGLE | PSP_CTRL_CROSS | PSP_CTRL_RIGHT |
+        PSP_CTRL_LEFT | PSP_CTRL_UP | PSP_CTRL_DOWN)) {
+        held = held < 0xFFFF ? held + 1 : held;
+    } else held = 0;
+    
     move = ajustCursor(move, 0);
     hrotate = ajustCursor(hrotate, 1);
     vrotate = ajustCursor(vrotate, 2);
     
     if((pad.Buttons & PSP_CTRL_SQUARE) &&
-        !(lpad.Buttons & PSP_CTRL_SQUARE)) {
-        DEPTH_OF_FIELD = !DEPTH_OF_FIELD;
+        !(lpad.Buttons & PSP_CTRL_SQUARE) && _DOF_MATRIX_REFS != NULL) {
+        DOF_SELECTED = !DOF_SELECTED;
+    }
+    
+    // While navigating the quality levels drop the DOF, then show the
+    // reduced frames, when they are in use, see quality.h
+    u8 drops[2];
+    u8 count = 0;
+    if(DOF_SELECTED) {
+        drops[count++] = DROP_DOF;
+    }
+    if(LOD_COUNT > 1) {
+        drops[count++] = DROP_LOD;
+    }
+    setQualitySteps(drops, count);
+    const u8 dof = DOF_SELECTED && !((pad.Buttons & QUALITY_BUTTONS) && isQualityDropped(DROP_DOF));
+    if(dof != DEPTH_OF_FIELD) {
+        DEPTH_OF_FIELD = dof;
+        preCalcDof(WIN_HEIGHT);
+        invalidateBands();
+        // The frame is not read when it goes straight into the texture
+        memset(loffsets, 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+    }
+    
+    if(TEXTURE_WIDTH > SCREEN_WIDTH) {
+        const u16 x = VIEW_X;
+        if((pad.Buttons & PSP_CTRL_LTRIGGER) && VIEW_X >= P) { VIEW_X -= P; }
+        if((pad.Buttons & PSP_CTRL_RTRIGGER) && VIEW_X + SCREEN_WIDTH + P <= TEXTURE_WIDTH) { VIEW_X += P; }
+        if(x != VIEW_X) {
+            generateRenderSurface();
+        }
     }
     
     lpad = pad;
-    return getOffset(move, hrotate, vrotate);
+    const u8 steps = getDepthSteps();
+    DEPTH_PHASE = DEPTH_OF_FIELD ? 0 : move % steps;
+    nextOffset = getOffset(move / steps + (DEPTH_PHASE ? 1 : 0), hrotate, vrotate);
+    return getOffset(move / steps, hrotate, vrotate);
 }
 
 u8 getPower(u16 value) {
@@ -362,8 +850,8 @@ u8 getPower(u16 value) {
 void getOptions() {
     FILE* f = fopen("options.txt", "r");
     if(f != NULL) {
-        char* options = (char*)memalign(16, 128);
-        fgets(options, 128, f);
+        char options[128];
+        fgets(options, sizeof(options), f);
         sscanf(options, "MPDEPTH:%f HPOV:%u VPOV:%u RAYSTEP:%u WBCOUNT:%u DBCOUNT:%u HSIZE:%u",
             &MAX_PROJECTION_DEPTH,
             &HORIZONTAL_POV_COUNT,
@@ -372,14 +860,28 @@ void getOptions() {
             &WIDTH_BLOCK_COUNT,
             &DEPTH_BLOCK_COUNT,
             &HEADER_SIZE);
+        TILED = strstr(options, "TILED:1") != NULL;
+        LATE_LATCH = strstr(options, "LATCH:1") != NULL;
+        ON_CHANGE = strstr(options, "ONCHANGE:1") != NULL;
+        DIRTY = strstr(options, "DIRTY:1") != NULL;
+        BLEND = strstr(options, "BLEND:1") != NULL;
+        TUNE = strstr(options, "TUNE:1") != NULL;
+        HUD = strstr(options, "HUD:0") == NULL;
+        DOF_AVAILABLE = strstr(options, "DOF:0") == NULL;
+        getLayoutSettings(options);
+        getBlockSettings(options);
+        getProbeSettings(options);
+        getQualitySettings(options);
+        getReplaySettings(options);
         fclose(f);
-        free(options);
     }
 }
 
 int main() {
+    profileStep("start");
     scePowerSetClockFrequency(333, 333, 166);    
     getOptions();
+    profileStep("options");
     
     if(MAX_PROJECTION_DEPTH > 0.0f) {
         PROJECTION_FACTOR = 1.0f / MAX_PROJECTION_DEPTH;  
@@ -390,77 +892,252 @@ int main() {
     WIN_HEIGHT_D2 = WIN_HEIGHT / 2;
     WIN_PIXELS_COUNT = WIN_WIDTH * WIN_HEIGHT;
     FRAME_BYTES_COUNT = WIN_PIXELS_COUNT * sizeof(u32);
-    SPACE_BYTES_COUNT = ((DEPTH_BLOCK_COUNT * SPACE_BLOCK_SIZE) / RAY_STEP) * FRAME_BYTES_COUNT;    
+    setLayout(HORIZONTAL_POV_COUNT * VERTICAL_POV_COUNT, (DEPTH_BLOCK_COUNT * SPACE_BLOCK_SIZE) / RAY_STEP);
     TEXTURE_WIDTH = TEXTURE_BLOCK_SIZE * WIDTH_BLOCK_COUNT;
-    SPACE_Y_OFFSET = getPower(TEXTURE_WIDTH);
-
-    u8* zpos = memalign(16, WIN_PIXELS_COUNT);
-    u32* base = memalign(16, FRAME_BYTES_COUNT);
-    frame = memalign(16, FRAME_BYTES_COUNT);
+    TILE_PIXELS_COUNT = TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE;
+    TILE_BYTES_COUNT = TILE_PIXELS_COUNT * sizeof(u32);
+    
+    openLods();
+    
+    // Every buffer lives in one arena sized from the options, the optional
+    // ones are planned last so they are the first dropped on a full heap
+    u8* zpos = NULL;
+    u32* base;
+    void* list;
+    planBuffer("list", &list, 1024, 0);
+    planBuffer("frame", &frame, FRAME_BYTES_COUNT, 0);
+    planBuffer("base", &base, FRAME_BYTES_COUNT, 0);
+    planBuffer("offsets", &loffsets, WIDTH_BLOCK_COUNT * sizeof(u64), 0);
+    planBuffer("surface", &quad, getSurfaceBytes(), 0);
+    planBuffer("draw lists", &drawLists, (LOD_LEVELS_COUNT + 1) * DRAW_LIST_BYTES_COUNT, 0);
+    if(MAX_PROJECTION_DEPTH > 0.0f) {
+        planBuffer("zpos", &zpos, WIN_PIXELS_COUNT, 0);
+        planBuffer("factors", &_FACTORS, 256 * sizeof(float), 0);
+        planBuffer("coordinates", &_COORDINATES, WIN_PIXELS_COUNT * sizeof(Coords), 0);
+    }
+    u32 stored;
+    const u32 dedupBytes = openDedup(HORIZONTAL_POV_COUNT * VERTICAL_POV_COUNT *
+        ((DEPTH_BLOCK_COUNT * SPACE_BLOCK_SIZE) / RAY_STEP), &stored);
+    if(dedupBytes) {
+        planBuffer("frame slots", &frameSlots, dedupBytes, 0);
+    }
+    const u32 occupancyBytes = openOccupancy(WIN_WIDTH, WIN_HEIGHT, stored);
+    if(occupancyBytes) {
+        planBuffer("occupancy", &occupancy, occupancyBytes, 1);
+    }
+    if(!TILED && WIDTH_BLOCK_COUNT > 1) {
+        planBuffer("rows", &rows, FRAME_BYTES_COUNT, 1);
+    }
+    planBlocks();
+    planProbe(WIN_PIXELS_COUNT, WIDTH_BLOCK_COUNT, 0);
+    planHud();
+    // Projected frames are scattered, each band depends on the whole frame
+    if(MAX_PROJECTION_DEPTH <= 0.0f) {
+        planDirty(WIDTH_BLOCK_COUNT * TILE_BANDS_COUNT);
+        if(BLEND) {
+            planBuffer("next", &next, FRAME_BYTES_COUNT, 1);
+            planBuffer("next offsets", &noffsets, WIDTH_BLOCK_COUNT * sizeof(u64), 1);
+        }
+    }
+    u8 level = 1;
+    while(level < LOD_COUNT) {
+        planBuffer("lod frame", &lodFrames[level], (WIN_PIXELS_COUNT >> (level * 2)) * sizeof(u32), 1);
+        planBuffer("lod offsets", &lodOffsets[level], WIDTH_BLOCK_COUNT * sizeof(u64), 1);
+        planBuffer("lod surface", &lodQuads[level], getSurfaceBytes(), 1);
+        level++;
+    }
+    const u32 frames = openReplay();
+    if(frames) {
+        planBuffer("replay times", &replayTimes, frames * sizeof(u32), 0);
+    }
+    // Planned last so they are the first dropped when the heap is short
+    if(DOF_AVAILABLE) {
+        planBuffer("dof", &_DOF, 256 * sizeof(float), 1);
+        planBuffer("dof refs", &_DOF_MATRIX_REFS, WIN_PIXELS_COUNT * sizeof(DofMatRef), 1);
+    }
+    requireArena("memory.txt");
+    loadDedup();
+    loadOccupancy();
+    buildHudAtlas();
     
-    void* list = memalign(16, 256);
+    // Reduced levels missing a buffer are not shown
+    level = 1;
+    while(level < LOD_COUNT && lodFrames[level] && lodOffsets[level] && lodQuads[level]) {
+        memset(lodOffsets[level], 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+        level++;
+    }
+    closeLods(level);
+    memset(loffsets, 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+    // Whole slices are shown without both blending buffers
+    if(next != NULL && noffsets != NULL) {
+        memset(noffsets, 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+    } else next = NULL;
+    profileStep("buffers");
     
     if(MAX_PROJECTION_DEPTH > 0.0f) {
         preCalculate();
+        profileStep("projection tables");
     }
     
     generateRenderSurface();
-    preCalcDof();
+    profileStep("lod and surface");
     sceGuInit();
     initGuContext(list);
     
     pspDebugScreenInitEx(NULL, PSP_DISPLAY_PIXEL_FORMAT_8888, 0);
     pspDebugScreenEnableBackColor(0);
+    profileStep("gu");
     
     openCloseIo(1);
+    profileStep("open");
+    
+    if(PROBE) {
+        runProbe(HEADER_SIZE, (u64)stored * FRAME_BYTES_COUNT, VERTICAL_POV_COUNT);
+        profileStep("probe");
+    }
+    
+    if(MAX_PROJECTION_DEPTH <= 0.0f) {
+        const Candidate copies[] = {
+            {COPY_DMA, "dma", copyDma},
+            {COPY_CPU, "cpu", copyCpu},
+            {COPY_DIRECT, "direct", readDirect}
+        };
+        tuneOffset = getOffset(getTuneMove(), 0, 0);
+        occupied = getFrameOccupancy(tuneOffset);
+        COPY_KERNEL = pickKernel("COPY", copies, 3, base);
+        memset(loffsets, 0xFF, WIDTH_BLOCK_COUNT * sizeof(u64));
+        invalidateBands();
+        writeTuned();
+        profileStep("tune");
+    }
     
     int dbuff = 0;
-    u64 size, prev, now, fps = 0;
+    u64 size = 0, prev, now, fps = 0;
+    u32 frameUs = 0;
+    u64 loffset = -1;
+    u32 lview = -1;
     const u64 tickResolution = sceRtcGetTickResolution();
 
     do {
         sceRtcGetCurrentTick(&prev);
+        latencyWait();
+        
+        const u64 offset = controls();
         
-        if(MAX_PROJECTION_DEPTH > 0.0f) {
-            memset(zpos, 0, WIN_PIXELS_COUNT);
+        // Reduced frames are shown as is while moving fast, the full frame
+        // is read and composed again once input settles
+        u8 lod = held >= LOD_HOLD_FRAMES * 4 ? 2 : (held >= LOD_HOLD_FRAMES ? 1 : 0);
+        lod = !lod && held && isQualityDropped(DROP_LOD) ? 1 : lod;
+        lod = lod < LOD_COUNT ? lod : LOD_COUNT - 1;
+        
+        // The displayed buffer is kept as long as the view does not change.
+        // Frames sharing the resident slot of a deduplicated capture have
+        // its offset, they are neither read nor composed again.
+        const u32 view = lod | DEPTH_OF_FIELD << 2 | VIEW_X << 3 | DEPTH_PHASE << 16;
+        const u8 resident = offset == loffset && view == lview;
+        if(ON_CHANGE && resident) {
+            if(!pad.Buttons) {
+                preCalcDof(8);
+            }
+            latencyIdle();
+            replayVblank();
+            latencyVblank();
+            replayFrameDone();
+            continue;
         }
+        loffset = offset;
+        lview = view;
+        occupied = getFrameOccupancy(offset);
         
+        if(!LISTS_READY) {
+            buildDrawLists(base);
+        }
         sceGuStart(GU_DIRECT, list);
         sceGuClear(GU_COLOR_BUFFER_BIT);
         
-        readIo(frame, controls());
-        getView(frame, zpos, base);
+        startQuality();
+        if(lod) {
+            readLod(offset, lod);
+        } else if(!resident) {
+            if(MAX_PROJECTION_DEPTH > 0.0f) {
+                readIo(frame, offset, 0, WIDTH_BLOCK_COUNT - 1, loffsets);
+                memset(zpos, 0, WIN_PIXELS_COUNT);
+                getView(frame, zpos, base);
+            } else {
+                const u8 direct = COPY_KERNEL == COPY_DIRECT && !DEPTH_OF_FIELD;
+                if(next != NULL) {
+                    keepSlices(direct ? base : frame, offset, nextOffset);
+                }
+                if(direct) {
+                    readIo(base, offset, FIRST_TILE, LAST_TILE, loffsets);
+                    sceKernelDcacheWritebackAll();
+                } else {
+                    readIo(frame, offset, FIRST_TILE, LAST_TILE, loffsets);
+                    markBands(frame);
+                    getView(frame, zpos, base);
+                }
+                if(DEPTH_PHASE) {
+                    const u8* const shown = occupied;
+                    occupied = getFrameOccupancy(nextOffset);
+                    readIo(next, nextOffset, FIRST_TILE, LAST_TILE, noffsets);
+                    sceKernelDcacheWritebackRange(next, FRAME_BYTES_COUNT);
+                    occupied = shown;
+                }
+            }
+        }
+        endQuality(&pad);
+        
+        sceGuCallList(&drawLists[lod * DRAW_LIST_BYTES_COUNT]);
+        if(!lod && DEPTH_PHASE) {
+            const u32 alpha = (DEPTH_PHASE * 255) / getDepthSteps();
+            sceGuEnable(GU_BLEND);
+            sceGuBlendFunc(GU_ADD, GU_FIX, GU_FIX, alpha * 0x010101, (255 - alpha) * 0x010101);
+            sceGuCallList(&drawLists[BLEND_LIST * DRAW_LIST_BYTES_COUNT]);
+            sceGuDisable(GU_BLEND);
+        }
         
-        sceGuTexImage(0, TEXTURE_WIDTH, TEXTURE_BLOCK_SIZE, TEXTURE_WIDTH, base);
-        sceGumDrawArray(GU_TRIANGLES, GU_TEXTURE_16BIT|GU_COLOR_8888|
-		GU_TRANSFORM_2D|GU_VERTEX_16BIT, VERTICES_COUNT, 0, quad);
+        hudPrintf("Fps: %llu, frame: %u us, DOF: %s\n", fps, frameUs, DEPTH_OF_FIELD ? "on" : "off");
+        hudPrintf("List size: %llu bytes, HUD: %u us\n", size, getHudUs());
+        hudPrintf("Startup: %u ms, memory: %u KB\n", getStartupMs(), arenaSize / 1024);
+        printLatency();
+        printDirty();
+        printBlocks();
+        printProbe();
+        printQuality();
+        drawHud();
         
         size = sceGuFinish();
         sceGuSync(GU_SYNC_FINISH, GU_SYNC_WHAT_DONE);
+        printHud(dbuff);
         
-        pspDebugScreenSetOffset(dbuff);
-        pspDebugScreenSetXY(0, 0);
-        pspDebugScreenSetTextColor(0xFF00A0FF);
-        pspDebugScreenPrintf("Fps: %llu, DOF: %s\n", fps, DEPTH_OF_FIELD ? "on" : "off");
-        pspDebugScreenPrintf("List size: %llu bytes.\n", size);
+        if(!pad.Buttons) {
+            preCalcDof(8);
+        }
         
-        sceDisplayWaitVblankStart();
+        latencyWorkDone();
+        replayVblank();
+        latencyVblank();
         dbuff = (int)sceGuSwapBuffers();
+        latencySwap();
+        
+        profileFirstFrame("startup.txt");
         
         sceRtcGetCurrentTick(&now);
         fps = tickResolution / (now - prev);
+        frameUs = ((now - prev) * 1000000) / tickResolution;
+        replayFrameDone();
     } while(!(pad.Buttons & PSP_CTRL_SELECT));
     
-    free(quad);
-    free(list);
-    free(zpos);
-    free(base);
-    free(frame);
-    free(_DOF);
-    free(_DOF_MATRIX_REFS);
-    free(_FACTORS);
-    free(_COORDINATES);
+    writeLatency("latency.txt");
+    writeDirty("dirty.txt");
+    writeBlocks("io.txt");
+    writeProbe("probe.txt");
+    writeQuality("quality.txt");
+    writeHud("hud.txt");
+    closeReplay("replay.txt");
     
+    freeArena();
+    closeLods(1);
     openCloseIo(0);
     sceKernelExitGame();
     return 0;
@@ -0,0 +1,108 @@
+/*
+ * APoV Project
+ * Per frame occupancy written by apov-transcode -O
+ */
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include "files.h"
+
+// The records of occupancy.bin, see files.h, are loaded at startup
+static u8* occupancy = NULL;
+static SceUID occupancyFd = -1;
+static u16 OCCUPANCY_COLUMNS;
+static u16 OCCUPANCY_ROWS;
+static u32 OCCUPANCY_RECORD_BYTES;
+static u32 OCCUPANCY_BYTES_COUNT = 0;
+
+typedef struct Box {
+    u16 x0, y0, x1, y1;
+} Box;
+
+// Opens the sidecar matching the window, returns the bytes to plan
+static u32 openOccupancy(const u16 width, const u16 height, const u32 frames) {
+    OCCUPANCY_COLUMNS = width / OCCUPANCY_CELL;
+    OCCUPANCY_ROWS = height / OCCUPANCY_CELL;
+    OCCUPANCY_RECORD_BYTES = OCCUPANCY_BOX_BYTES_COUNT + (OCCUPANCY_COLUMNS * OCCUPANCY_ROWS) / 8;
+    occupancyFd = sceIoOpen(OCCUPANCY_FILE, PSP_O_RDONLY, 0777);
+    if(occupancyFd < 0) {
+        return 0;
+    }
+    OCCUPANCY_BYTES_COUNT = frames * OCCUPANCY_RECORD_BYTES;
+    if(sceIoLseek(occupancyFd, 0, SEEK_END) != OCCUPANCY_BYTES_COUNT) {
+        sceIoClose(occupancyFd);
+        occupancyFd = -1;
+        return 0;
+    }
+    sceIoLseek(occupancyFd, 0, SEEK_SET);
+    return OCCUPANCY_BYTES_COUNT;
+}
+
+// Reads the records in the planned buffer, dropped when it did not fit
+static void loadOccupancy() {
+    if(occupancyFd < 0) {
+        return;
+    }
+    if(occupancy != NULL &&
+        OCCUPANCY_BYTES_COUNT != sceIoRead(occupancyFd, occupancy, OCCUPANCY_BYTES_COUNT)) {
+        occupancy = NULL;
+    }
+    sceIoClose(occupancyFd);
+}
+
+// Returns the record of a frame, NULL when the occupancy is not known
+static const u8* getOccupancy(const u32 index) {
+    return occupancy != NULL ? &occupancy[index * OCCUPANCY_RECORD_BYTES] : NULL;
+}
+
+static const Box* getBox(const u8* const record) {
+    return (const Box*)record;
+}
+
+static u8 isCellOccupied(const u8* const record, const u16 cx, const u16 cy) {
+    const u32 bit = cy * OCCUPANCY_COLUMNS + cx;
+    return record[OCCUPANCY_BOX_BYTES_COUNT + bit / 8] & (1 << (bit % 8));
+}
+
+// True when the cell or one of its neighbours is occupied, for the kernels
+// reading a few pixels around each one
+static u8 isCellNear(const u8* const record, const u16 cx, const u16 cy) {
+    const u16 x0 = cx ? cx - 1 : 0;
+    const u16 y0 = cy ? cy - 1 : 0;
+    const u16 x1 = cx + 1 < OCCUPANCY_COLUMNS ? cx + 1 : cx;
+    const u16 y1 = cy + 1 < OCCUPANCY_ROWS ? cy + 1 : cy;
+    u16 y = y0;
+    while(y <= y1) {
+        u16 x = x0;
+        while(x <= x1) {
+            if(isCellOccupied(record, x, y)) {
+                return 1;
+            }
+            x++;
+        }
+        y++;
+    }
+    return 0;
+}
+
+static u32 getOccupiedCells(const u8* const record) {
+    u32 count = 0;
+    u32 i = (OCCUPANCY_COLUMNS * OCCUPANCY_ROWS) / 8;
+    while(i--) {
+        u8 bits = record[OCCUPANCY_BOX_BYTES_COUNT + i];
+        while(bits) {
+            bits &= bits - 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+// True when no cell of the columns [x, x + width) is occupied
+static u8 isSpanEmpty(const u8* const record, const u16 x, const u16 width) {
+    const Box* const box = getBox(record);
+    return box->x1 <= x || box->x0 >= x + width;
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * APoV Project
+ * Storage throughput at the frame size of each capture format
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#define PROBE_FORMATS_COUNT 3
+#define PROBE_PATTERNS_COUNT 3
+#define PROBE_MAP_SIZE 8
+
+static const char* const PROBE_FORMATS[PROBE_FORMATS_COUNT] = {"raw", "clut", "1bcm"};
+static const char* const PROBE_PATTERNS[PROBE_PATTERNS_COUNT] = {"depth", "rotate", "random"};
+
+// PROBE:N reads N frames of each pattern at startup, at the frame size a raw,
+// clut or 1bcm capture of the same options would have. Depth steps every
+// depth of a POV, rotate turns around at a depth, random jumps anywhere, at
+// the offsets getOffset would give in that format. The reads go through
+// readShards over the capture of the stick, wrapping past its end, so the
+// frames per second each format could be fed at are known before capturing
+// it. They are written to probe.txt.
+static u32 PROBE = 0;
+static u8* probeFrame = NULL;
+static u32 probeBytes[PROBE_FORMATS_COUNT];
+static u32 probeFps[PROBE_FORMATS_COUNT][PROBE_PATTERNS_COUNT];
+
+static void getProbeSettings(const char* const options) {
+    const char* setting;
+    if((setting = strstr(options, "PROBE:")) != NULL) {
+        sscanf(setting, "PROBE:%u", &PROBE);
+    }
+}
+
+// The 1bcm frames use mapSize, or the apov-transcode default when 0. The
+// buffer holds a raw frame, the probe is skipped on a full heap.
+static void planProbe(const u32 pixels, const u32 widthBlocks, const u32 mapSize) {
+    if(!PROBE) {
+        return;
+    }
+    const u32 map = mapSize ? mapSize : PROBE_MAP_SIZE;
+    probeBytes[0] = pixels * sizeof(u32);
+    probeBytes[1] = pixels * sizeof(u8);
+    probeBytes[2] = pixels / 8 + map * widthBlocks * map * sizeof(u32);
+    planBuffer("probe frame", &probeFrame, probeBytes[0], 1);
+}
+
+static u32 getProbeIndex(const u8 pattern, const u32 i, u32* const seed, const u32 vertical) {
+    const u32 povs = LAYOUT_POV_COUNT;
+    const u32 depths = LAYOUT_DEPTH_COUNT;
+    if(pattern == 0) {
+        return getFrameIndex((i / depths) % povs, i % depths);
+    } else if(pattern == 1) {
+        const u32 horizontal = povs / vertical;
+        const u32 pov = (i % horizontal) * vertical + (i / horizontal) % vertical;
+        return getFrameIndex(pov, (i / povs) % depths);
+    }
+    *seed = *seed * 1103515245 + 12345;
+    return getFrameIndex((*seed >> 8) % povs, (*seed >> 16) % depths);
+}
+
+// Frames start at start and span bytes, as stored by the running format.
+// Frames larger than the span stay at 0 fps.
+static void runProbe(const u64 start, const u64 span, const u32 vertical) {
+    if(probeFrame == NULL) {
+        return;
+    }
+    u8 format = 0;
+    while(format < PROBE_FORMATS_COUNT) {
+        const u32 nbytes = probeBytes[format];
+        const u32 fit = span / nbytes;
+        u8 pattern = 0;
+        while(fit && pattern < PROBE_PATTERNS_COUNT) {
+            resetBlocks();
+            u32 seed = 1;
+            const u32 begin = sceKernelGetSystemTimeLow();
+            u32 i = 0;
+            while(i < PROBE) {
+                const u32 index = getProbeIndex(pattern, i, &seed, vertical) % fit;
+                readShards(probeFrame, start + (u64)index * nbytes, nbytes);
+                i++;
+            }
+            const u32 elapsed = sceKernelGetSystemTimeLow() - begin;
+            probeFps[format][pattern] = elapsed ? ((u64)PROBE * 1000000) / elapsed : 0;
+            pattern++;
+        }
+        format++;
+    }
+    // The navigation starts from a clean window and counts
+    resetBlocks();
+    clearBlocks();
+}
+
+// Random reads are the worst case of the navigation
+static void printProbe() {
+    if(probeFrame != NULL) {
+        hudPrintf("Probe: raw %u, clut %u, 1bcm %u fps\n",
+            probeFps[0][2], probeFps[1][2], probeFps[2][2]);
+    }
+}
+
+static void writeProbe(const char* const path) {
+    if(probeFrame == NULL) {
+        return;
+    }
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[192];
+    int n = snprintf(line, sizeof(line), "frames: %u per pattern, window: %u KB\n",
+        PROBE, ioWindow != NULL ? IO_WINDOW / 1024 : 0);
+    sceIoWrite(log, line, n);
+    u8 format = 0;
+    while(format < PROBE_FORMATS_COUNT) {
+        n = snprintf(line, sizeof(line), "%s: %u bytes", PROBE_FORMATS[format], probeBytes[format]);
+        u8 pattern = 0;
+        while(pattern < PROBE_PATTERNS_COUNT) {
+            const u32 fps = probeFps[format][pattern];
+            const u32 rate = ((u64)fps * probeBytes[format] * 10) / 1000000;
+            n += snprintf(&line[n], sizeof(line) - n, ", %s %u fps %u.%u MB/s",
+                PROBE_PATTERNS[pattern], fps, rate / 10, rate % 10);
+            pattern++;
+        }
+        n += snprintf(&line[n], sizeof(line) - n, "\n");
+        sceIoWrite(log, line, n);
+        format++;
+    }
+    sceIoClose(log);
+}
+
+#endif
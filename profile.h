@@ -0,0 +1,64 @@
+/*
+ * APoV Project
+ * Startup timing breakdown shared by the navigators
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#define PROFILE_STEPS_COUNT 16
+
+typedef struct Step {
+    const char* name;
+    u64 tick;
+} Step;
+
+static Step steps[PROFILE_STEPS_COUNT];
+static u8 stepCount = 0;
+
+// Marks the end of a startup step, the first call marks the start
+static void profileStep(const char* const name) {
+    if(stepCount < PROFILE_STEPS_COUNT) {
+        sceRtcGetCurrentTick(&steps[stepCount].tick);
+        steps[stepCount].name = name;
+        stepCount++;
+    }
+}
+
+static u32 getProfileMs(const u8 from, const u8 to) {
+    return ((steps[to].tick - steps[from].tick) * 1000) / sceRtcGetTickResolution();
+}
+
+// Total time from the first step to the last one
+static u32 getStartupMs() {
+    return stepCount > 1 ? getProfileMs(0, stepCount - 1) : 0;
+}
+
+// Writes one line per step with its own and cumulated durations
+static void writeProfile(const char* const path) {
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[64];
+    u8 i = 1;
+    while(i < stepCount) {
+        const int n = snprintf(line, sizeof(line), "%s: %u ms (%u ms)\n",
+            steps[i].name, getProfileMs(i - 1, i), getProfileMs(0, i));
+        sceIoWrite(log, line, n);
+        i++;
+    }
+    sceIoClose(log);
+}
+
+// Closes the profile on the first displayed frame and saves it once
+static void profileFirstFrame(const char* const path) {
+    static u8 done = 0;
+    if(!done) {
+        done = 1;
+        profileStep("first frame");
+        writeProfile(path);
+    }
+}
+
+#endif
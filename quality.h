@@ -0,0 +1,133 @@
+/*
+ * APoV Project
+ * Quality stepped down while navigating to hold a frame time
+ */
+
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#define QUALITY_HOLD_FRAMES 8
+#define QUALITY_LEVELS_MAX 4
+#define QUALITY_LOG_BYTES_COUNT 4096
+#define QUALITY_BUTTONS (PSP_CTRL_TRIANGLE | PSP_CTRL_CROSS | PSP_CTRL_RIGHT | PSP_CTRL_LEFT | \
+    PSP_CTRL_UP | PSP_CTRL_DOWN | PSP_CTRL_LTRIGGER | PSP_CTRL_RTRIGGER)
+
+// QUALITY:US sets the target read and compose time of a frame, in us, as
+// 16666 or 33333. While navigating, the level goes one step down once the
+// mean time of the last frames is over the target, and one step up once it
+// is under 3/4 of it, at most every QUALITY_HOLD_FRAMES frames. Each
+// navigator lists the passes in use, level n drops the first n of them, so
+// no level is spent on a pass that is off. The full quality is
+// back as soon as the buttons are released. Changes are logged to
+// quality.txt with the times they were based on.
+static u32 QUALITY = 0;
+static u8 QUALITY_LEVELS_COUNT = 1;
+static u8 qualityLevel = 0;
+static u8 qualitySteps[QUALITY_LEVELS_MAX];
+static u8 qualityHeld = 0;
+static u32 qualityStart = 0;
+static u32 qualityWork = 0;
+static u32 qualityMean = 0;
+static u32 qualityFrames = 0;
+static u32 qualityLevelFrames[QUALITY_LEVELS_MAX];
+static char qualityLog[QUALITY_LOG_BYTES_COUNT];
+static u32 qualityLogLength = 0;
+
+static void getQualitySettings(const char* const options) {
+    const char* setting;
+    if((setting = strstr(options, "QUALITY:")) != NULL) {
+        sscanf(setting, "QUALITY:%u", &QUALITY);
+    }
+}
+
+static void setQualityLevel(const u8 level, const char* const reason) {
+    if(qualityLogLength < QUALITY_LOG_BYTES_COUNT) {
+        qualityLogLength += snprintf(&qualityLog[qualityLogLength],
+            QUALITY_LOG_BYTES_COUNT - qualityLogLength, "frame %u: level %u -> %u, %s, work %u us, mean %u us\n",
+            qualityFrames, qualityLevel, level, reason, qualityWork, qualityMean);
+        qualityLogLength = qualityLogLength < QUALITY_LOG_BYTES_COUNT ?
+            qualityLogLength : QUALITY_LOG_BYTES_COUNT - 1;
+    }
+    qualityLevel = level;
+    qualityHeld = 0;
+}
+
+// Lists the passes in use in the order they are dropped, none leaves the
+// controller off. Called every frame, a pass may be turned on or off.
+static void setQualitySteps(const u8* const steps, const u8 count) {
+    const u8 n = count < QUALITY_LEVELS_MAX ? count : QUALITY_LEVELS_MAX - 1;
+    memcpy(qualitySteps, steps, n);
+    QUALITY_LEVELS_COUNT = n + 1;
+    if(qualityLevel >= QUALITY_LEVELS_COUNT) {
+        setQualityLevel(n, "passes");
+    }
+}
+
+static u8 isQualityDropped(const u8 step) {
+    u8 i = 0;
+    while(i < qualityLevel) {
+        if(qualitySteps[i++] == step) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Called before the frame is read
+static void startQuality() {
+    qualityStart = sceKernelGetSystemTimeLow();
+}
+
+// Called once the frame is composed, picks the level of the next one
+static void endQuality(const SceCtrlData* const pad) {
+    qualityWork = sceKernelGetSystemTimeLow() - qualityStart;
+    qualityMean = qualityFrames ? (qualityMean * 3 + qualityWork) / 4 : qualityWork;
+    qualityLevelFrames[qualityLevel]++;
+    qualityFrames++;
+    if(!QUALITY || QUALITY_LEVELS_COUNT < 2) {
+        return;
+    }
+    qualityHeld = qualityHeld < 0xFF ? qualityHeld + 1 : qualityHeld;
+    if(!(pad->Buttons & QUALITY_BUTTONS)) {
+        if(qualityLevel) {
+            setQualityLevel(0, "stopped");
+        }
+    } else if(qualityHeld >= QUALITY_HOLD_FRAMES) {
+        if(qualityMean > QUALITY && qualityLevel + 1 < QUALITY_LEVELS_COUNT) {
+            setQualityLevel(qualityLevel + 1, "over");
+        } else if(qualityMean < (QUALITY * 3) / 4 && qualityLevel) {
+            setQualityLevel(qualityLevel - 1, "under");
+        }
+    }
+}
+
+static void printQuality() {
+    if(QUALITY) {
+        hudPrintf("Quality: level %u/%u, work %u us, target %u us\n",
+            qualityLevel, QUALITY_LEVELS_COUNT - 1, qualityMean, QUALITY);
+    }
+}
+
+// Writes the frames composed at each level, then the changes
+static void writeQuality(const char* const path) {
+    if(!QUALITY) {
+        return;
+    }
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    char line[80];
+    int n = snprintf(line, sizeof(line), "target: %u us, %u frames\n", QUALITY, qualityFrames);
+    sceIoWrite(log, line, n);
+    u8 level = 0;
+    while(level < QUALITY_LEVELS_COUNT) {
+        n = snprintf(line, sizeof(line), "level %u: %u frames\n", level, qualityLevelFrames[level]);
+        sceIoWrite(log, line, n);
+        level++;
+    }
+    sceIoWrite(log, qualityLog, qualityLogLength);
+    sceIoClose(log);
+}
+
+#endif
@@ -0,0 +1,444 @@
+/*
+ * APoV Project offline batch renderer
+ * Decodes every (hrotate, vrotate, move) frame of a capture with the
+ * navigators' compose code and exports it as PPM images or a raw RGB stream.
+ * A pad recording of a navigator can be replayed instead, as a scripted pad.
+ */
+
+#include "apov.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <getopt.h>
+
+typedef struct Job {
+    Capture* capture;
+    u8 dof;
+    u8 mode;
+    const char* outDir;
+    int stream;
+    atomic_uint nextPov;
+    atomic_ullong frames;
+    atomic_int failed;
+} Job;
+
+// Navigator pad recording entry, laid out as SceCtrlData
+typedef struct Pad {
+    u32 timeStamp;
+    u32 buttons;
+    u8 lx, ly;
+    u8 reserved[6];
+} Pad;
+
+#define PAD_SELECT 0x000001
+#define PAD_UP 0x000010
+#define PAD_RIGHT 0x000020
+#define PAD_DOWN 0x000040
+#define PAD_LEFT 0x000080
+#define PAD_TRIANGLE 0x001000
+#define PAD_CROSS 0x004000
+#define PAD_SQUARE 0x008000
+
+static void toRgb(const u32* const base, u8* const rgb, const u32 count) {
+    u32 i = count;
+    while(i--) {
+        const u32 p = base[i];
+        rgb[i * 3 + 0] = p & 0xFF;
+        rgb[i * 3 + 1] = (p >> 8) & 0xFF;
+        rgb[i * 3 + 2] = (p >> 16) & 0xFF;
+    }
+}
+
+static int writePpm(const Job* const job, const u8* const rgb,
+    const int hrotate, const int vrotate, const int move) {
+    const Capture* const c = job->capture;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/h%03d-v%03d-d%03d.ppm", job->outDir, hrotate, vrotate, move);
+    FILE* const f = fopen(path, "wb");
+    if(f == NULL) {
+        return -1;
+    }
+    fprintf(f, "P6\n%u %u\n255\n", c->WIN_WIDTH, c->WIN_HEIGHT);
+    const size_t n = fwrite(rgb, c->WIN_PIXELS_COUNT * 3, 1, f);
+    return (fclose(f) || n != 1) ? -1 : 0;
+}
+
+// Frames are written at a fixed position of the stream, in the capture
+// order, so workers never wait on each other
+static int writeStream(const Job* const job, const u8* const rgb, const u64 index) {
+    const u32 nbytes = job->capture->WIN_PIXELS_COUNT * 3;
+    u32 done = 0;
+    while(done < nbytes) {
+        const ssize_t n = pwrite(job->stream, rgb + done, nbytes - done, index * nbytes + done);
+        if(n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void* renderPovs(void* const arg) {
+    Job* const job = arg;
+    const Capture* const c = job->capture;
+
+    u8* const frame = malloc(c->FRAME_BYTES_COUNT);
+    u8* const zpos = malloc(c->WIN_PIXELS_COUNT);
+    u32* const base = malloc(c->WIN_PIXELS_COUNT * sizeof(u32));
+    u8* const rgb = malloc(c->WIN_PIXELS_COUNT * 3);
+    if(frame == NULL || zpos == NULL || base == NULL || rgb == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        job->failed = 1;
+    }
+
+    u32 pov;
+    while(!job->failed && (pov = atomic_fetch_add(&job->nextPov, 1)) < c->POV_COUNT) {
+        const int hrotate = pov / c->VERTICAL_POV_COUNT;
+        const int vrotate = pov % c->VERTICAL_POV_COUNT;
+        u32 move = 0;
+        while(move < c->DEPTH_FRAME_COUNT) {
+            if(readFrame(c, frame, getOffset(c, move, hrotate, vrotate))) {
+                fprintf(stderr, "Short read at pov %u, move %u\n", pov, move);
+                job->failed = 1;
+                break;
+            }
+
+            if(c->FORMAT == FORMAT_RAW) {
+                getRawView(c, (const u32*)frame, zpos, base, job->dof);
+            } else if(c->FORMAT == FORMAT_CLUT) {
+                getClutView(c, frame, base);
+            } else get1bcmView(c, frame, base, job->mode);
+
+            if(job->outDir || job->stream >= 0) {
+                toRgb(base, rgb, c->WIN_PIXELS_COUNT);
+                const int err = job->outDir ?
+                    writePpm(job, rgb, hrotate, vrotate, move) :
+                    writeStream(job, rgb, (u64)pov * c->DEPTH_FRAME_COUNT + move);
+                if(err) {
+                    fprintf(stderr, "Write failed at pov %u, move %u\n", pov, move);
+                    job->failed = 1;
+                    break;
+                }
+            }
+            atomic_fetch_add(&job->frames, 1);
+            move++;
+        }
+    }
+
+    free(frame);
+    free(zpos);
+    free(base);
+    free(rgb);
+    return NULL;
+}
+
+// Same cursor rules as the navigators controls()
+static int ajustCursor(const Capture* const c, const int value, const u8 mode) {
+    if(!mode) {
+        return value < 0 ? 0 : (value >= (int)c->DEPTH_FRAME_COUNT ? (int)c->DEPTH_FRAME_COUNT - 1 : value);
+    }
+    const int max = mode == 1 ? c->HORIZONTAL_POV_COUNT : c->VERTICAL_POV_COUNT;
+    return value < 0 ? max - 1 : (value >= max ? 0 : value);
+}
+
+// Plays a pad recording on one thread, a frame is read and composed when the
+// cursor moves (every frame for raw, as the navigator does), the stream gets
+// one image per replayed frame
+static int replayPads(Job* const job, const char* const path) {
+    const Capture* const c = job->capture;
+    FILE* const f = fopen(path, "rb");
+    if(f == NULL) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    const u32 count = ftell(f) / sizeof(Pad);
+    fseek(f, 0, SEEK_SET);
+    Pad* const pads = malloc(count * sizeof(Pad));
+    double* const times = malloc(count * sizeof(double));
+    const u32 read = pads != NULL ? fread(pads, sizeof(Pad), count, f) : 0;
+    fclose(f);
+
+    u8* const frame = malloc(c->FRAME_BYTES_COUNT);
+    u8* const zpos = malloc(c->WIN_PIXELS_COUNT);
+    u32* const base = malloc(c->WIN_PIXELS_COUNT * sizeof(u32));
+    u8* const rgb = malloc(c->WIN_PIXELS_COUNT * 3);
+    if(pads == NULL || times == NULL || frame == NULL || zpos == NULL || base == NULL || rgb == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        job->failed = 1;
+    }
+
+    int move = 0, hrotate = 0, vrotate = 0;
+    u32 lbuttons = 0;
+    u64 loffset = -1;
+    u32 i = 0;
+    const double start = getSeconds();
+    while(!job->failed && i < read && !(pads[i].buttons & PAD_SELECT)) {
+        const double t = getSeconds();
+        const u32 buttons = pads[i].buttons;
+        if(buttons & PAD_TRIANGLE) { move++; }
+        if(buttons & PAD_CROSS) { move--; }
+        if(buttons & PAD_RIGHT) { hrotate--; }
+        if(buttons & PAD_LEFT) { hrotate++; }
+        if(buttons & PAD_UP) { vrotate--; }
+        if(buttons & PAD_DOWN) { vrotate++; }
+        move = ajustCursor(c, move, 0);
+        hrotate = ajustCursor(c, hrotate, 1);
+        vrotate = ajustCursor(c, vrotate, 2);
+        if((buttons & PAD_SQUARE) && !(lbuttons & PAD_SQUARE)) {
+            job->dof = !job->dof;
+            job->mode = !job->mode;
+            loffset = -1;
+        }
+        lbuttons = buttons;
+
+        const u64 offset = getOffset(c, move, hrotate, vrotate);
+        if(offset != loffset || c->FORMAT == FORMAT_RAW) {
+            if(offset != loffset && readFrame(c, frame, offset)) {
+                fprintf(stderr, "Short read at frame %u\n", i);
+                job->failed = 1;
+                break;
+            }
+            loffset = offset;
+            if(c->FORMAT == FORMAT_RAW) {
+                getRawView(c, (const u32*)frame, zpos, base, job->dof);
+            } else if(c->FORMAT == FORMAT_CLUT) {
+                getClutView(c, frame, base);
+            } else get1bcmView(c, frame, base, job->mode);
+        }
+        if(job->stream >= 0) {
+            toRgb(base, rgb, c->WIN_PIXELS_COUNT);
+            if(writeStream(job, rgb, i)) {
+                fprintf(stderr, "Write failed at frame %u\n", i);
+                job->failed = 1;
+                break;
+            }
+        }
+        times[i++] = getSeconds() - t;
+    }
+    const double elapsed = getSeconds() - start;
+    job->frames = i;
+
+    printf("Replay: %u frames in %.3f ms\n", i, elapsed * 1000.0);
+    u32 n = 0;
+    while(n < i) {
+        printf("%u %.3f\n", n, times[n] * 1000.0);
+        n++;
+    }
+
+    free(pads);
+    free(times);
+    free(frame);
+    free(zpos);
+    free(base);
+    free(rgb);
+    return job->failed ? -1 : 0;
+}
+
+#define BENCH_FRAMES_COUNT 64
+#define BENCH_RUNS_COUNT 5
+
+static const char* const KERNEL_NAMES[] = {"generic", "256x256", "512x256"};
+
+static void composeWith(const Job* const job, const u8* const frame, u8* const zpos, u32* const base,
+    const u8 specialized) {
+    const Capture* const c = job->capture;
+    if(c->FORMAT == FORMAT_RAW) {
+        if(specialized) {
+            getRawView(c, (const u32*)frame, zpos, base, job->dof);
+        } else getRawViewAny(c, (const u32*)frame, zpos, base, job->dof);
+    } else if(specialized) {
+        get1bcmView(c, frame, base, job->mode);
+    } else get1bcmViewAny(c, frame, base, job->mode);
+}
+
+// Composes the first frames of the capture with the generic kernel and the
+// one specialized for its geometry, checks every frame matches, then keeps
+// the best of a few runs of each
+static int benchKernels(const Job* const job) {
+    const Capture* const c = job->capture;
+    const u8 geometry = getKernelGeometry(c);
+    if(c->FORMAT == FORMAT_CLUT || geometry == KERNEL_ANY) {
+        printf("Kernels %ux%u: no specialized kernel\n", c->WIN_WIDTH, c->WIN_HEIGHT);
+        return 0;
+    }
+    const u32 total = c->POV_COUNT * c->DEPTH_FRAME_COUNT;
+    const u32 count = total < BENCH_FRAMES_COUNT ? total : BENCH_FRAMES_COUNT;
+    u8* const frames = malloc((u64)count * c->FRAME_BYTES_COUNT);
+    u8* const zpos = malloc(c->WIN_PIXELS_COUNT);
+    u32* const base = malloc(c->WIN_PIXELS_COUNT * sizeof(u32));
+    u32* const check = malloc(c->WIN_PIXELS_COUNT * sizeof(u32));
+    int err = frames == NULL || zpos == NULL || base == NULL || check == NULL;
+    if(err) {
+        fprintf(stderr, "Out of memory for %u frames\n", count);
+    }
+    u32 n = 0;
+    while(n < count && !err) {
+        const u32 pov = n / c->DEPTH_FRAME_COUNT;
+        err = readFrame(c, &frames[(u64)n * c->FRAME_BYTES_COUNT],
+            getOffset(c, n % c->DEPTH_FRAME_COUNT, pov / c->VERTICAL_POV_COUNT, pov % c->VERTICAL_POV_COUNT));
+        n++;
+    }
+    if(err && n) {
+        fprintf(stderr, "Short read at frame %u\n", n - 1);
+    }
+
+    n = 0;
+    while(!err && n < count) {
+        const u8* const frame = &frames[(u64)n * c->FRAME_BYTES_COUNT];
+        composeWith(job, frame, zpos, check, 0);
+        composeWith(job, frame, zpos, base, 1);
+        if(memcmp(check, base, c->WIN_PIXELS_COUNT * sizeof(u32))) {
+            fprintf(stderr, "The %s kernel differs from the generic one at frame %u\n",
+                KERNEL_NAMES[geometry], n);
+            err = 1;
+        }
+        n++;
+    }
+
+    double best[2] = {1e9, 1e9};
+    u8 run = 0;
+    while(!err && run < BENCH_RUNS_COUNT * 2) {
+        const u8 specialized = run & 1;
+        const double start = getSeconds();
+        n = 0;
+        while(n < count) {
+            composeWith(job, &frames[(u64)n * c->FRAME_BYTES_COUNT], zpos, base, specialized);
+            n++;
+        }
+        const double elapsed = (getSeconds() - start) * 1000.0 / count;
+        best[specialized] = elapsed < best[specialized] ? elapsed : best[specialized];
+        run++;
+    }
+    if(!err) {
+        printf("Kernels %ux%u, %u frames: generic %.3f ms, %s %.3f ms per frame (%.2fx)\n",
+            c->WIN_WIDTH, c->WIN_HEIGHT, count, best[0], KERNEL_NAMES[geometry], best[1], best[0] / best[1]);
+    }
+
+    free(frames);
+    free(zpos);
+    free(base);
+    free(check);
+    return err ? -1 : 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: apov-render [options] DIR\n"
+        "  -f FORMAT  raw, clut or 1bcm (default raw)\n"
+        "  -d         raw: enable depth of field\n"
+        "  -m MODE    1bcm: 0 plain, 1 smoothing (default 0)\n"
+        "  -o DIR     write one PPM image per frame\n"
+        "  -s FILE    write a raw rgb24 stream, POV major\n"
+        "  -j COUNT   worker threads (default: all cores)\n"
+        "  -p FILE    replay a navigator pad recording (pad.rec) instead,\n"
+        "             prints the total and per frame times in ms\n"
+        "  -k         time the compose kernel specialized for the window\n"
+        "             geometry against the generic one\n"
+        "DIR holds the capture and its options, as on the memory stick.\n");
+}
+
+int main(int argc, char** argv) {
+    Job job = {0};
+    u8 format = FORMAT_RAW;
+    const char* streamPath = NULL;
+    const char* padPath = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    u8 bench = 0;
+    job.stream = -1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "f:dm:o:s:j:p:kh")) != -1) {
+        int v;
+        switch(opt) {
+            case 'f':
+                if((v = getFormat(optarg)) < 0) {
+                    usage();
+                    return 1;
+                }
+                format = v;
+                break;
+            case 'd': job.dof = 1; break;
+            case 'm': job.mode = atoi(optarg) ? 1 : 0; break;
+            case 'o': job.outDir = optarg; break;
+            case 's': streamPath = optarg; break;
+            case 'j': threads = atol(optarg); break;
+            case 'p': padPath = optarg; break;
+            case 'k': bench = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if(optind != argc - 1 || threads < 1) {
+        usage();
+        return 1;
+    }
+    if(job.outDir && (streamPath || padPath)) {
+        fprintf(stderr, "-o cannot be combined with -s or -p\n");
+        return 1;
+    }
+
+    Capture capture;
+    if(openCapture(&capture, argv[optind], format)) {
+        fprintf(stderr, "Unable to open the %s capture in %s\n", FORMAT_NAMES[format], argv[optind]);
+        closeCapture(&capture);
+        return 1;
+    }
+    job.capture = &capture;
+
+    if(bench) {
+        const int err = benchKernels(&job);
+        closeCapture(&capture);
+        return err ? 1 : 0;
+    }
+
+    if(streamPath) {
+        job.stream = open(streamPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(job.stream < 0) {
+            fprintf(stderr, "Unable to create %s\n", streamPath);
+            closeCapture(&capture);
+            return 1;
+        }
+    }
+
+    if(padPath) {
+        const int err = replayPads(&job, padPath);
+        if(job.stream >= 0) {
+            close(job.stream);
+        }
+        closeCapture(&capture);
+        return err ? 1 : 0;
+    }
+
+    if(threads > capture.POV_COUNT) {
+        threads = capture.POV_COUNT;
+    }
+
+    const double start = getSeconds();
+    pthread_t* const workers = malloc(threads * sizeof(pthread_t));
+    long i = 0;
+    while(i < threads) {
+        pthread_create(&workers[i++], NULL, renderPovs, &job);
+    }
+    while(i--) {
+        pthread_join(workers[i], NULL);
+    }
+    const double elapsed = getSeconds() - start;
+    free(workers);
+
+    const u64 frames = job.frames;
+    printf("%s %ux%u, %u POV x %u depth, %ld threads\n",
+        FORMAT_NAMES[format], capture.WIN_WIDTH, capture.WIN_HEIGHT,
+        capture.POV_COUNT, capture.DEPTH_FRAME_COUNT, threads);
+    printf("Frames: %llu in %.3f s, %.1f fps, %.1f MB/s read\n",
+        (unsigned long long)frames, elapsed, frames / elapsed,
+        (frames * (double)capture.FRAME_BYTES_COUNT) / (elapsed * 1048576.0));
+
+    if(job.stream >= 0) {
+        close(job.stream);
+        printf("Stream: rgb24 %ux%u, %llu frames\n",
+            capture.WIN_WIDTH, capture.WIN_HEIGHT, (unsigned long long)frames);
+    }
+    closeCapture(&capture);
+    return job.failed ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * APoV Project
+ * Pad recording and replay for repeatable runs
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#define REPLAY_FILE "pad.rec"
+#define REPLAY_CHUNK_COUNT 256
+#define REPLAY_VBLANK 1
+#define REPLAY_FAST 2
+
+// RECORD:1 saves the pad seen by each frame. REPLAY:1 plays it back locked
+// on the vblank, REPLAY:2 as fast as possible. SELECT still leaves.
+static u32 RECORD = 0;
+static u32 REPLAY = 0;
+
+static SceUID replayFd = -1;
+static SceCtrlData chunk[REPLAY_CHUNK_COUNT];
+static u32 chunkCount = 0;
+static u32 chunkIndex = 0;
+static u32 replayFrames = 0;
+static u32 replayFrame = 0;
+static u32* replayTimes = NULL;
+static u32 replayTime = 0;
+
+static void getReplaySettings(const char* const options) {
+    const char* setting;
+    if((setting = strstr(options, "RECORD:")) != NULL) {
+        sscanf(setting, "RECORD:%u", &RECORD);
+    }
+    if((setting = strstr(options, "REPLAY:")) != NULL) {
+        sscanf(setting, "REPLAY:%u", &REPLAY);
+    }
+}
+
+// Opens the recording, returns the number of frames to replay
+static u32 openReplay() {
+    if(REPLAY) {
+        replayFd = sceIoOpen(REPLAY_FILE, PSP_O_RDONLY, 0777);
+        if(replayFd < 0) {
+            REPLAY = 0;
+            return 0;
+        }
+        RECORD = 0;
+        replayFrames = sceIoLseek(replayFd, 0, SEEK_END) / sizeof(SceCtrlData);
+        sceIoLseek(replayFd, 0, SEEK_SET);
+        return replayFrames;
+    } else if(RECORD) {
+        replayFd = sceIoOpen(REPLAY_FILE, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+        RECORD = replayFd >= 0;
+    }
+    return 0;
+}
+
+// Replaces the pad with the next recorded one, a missing frame or SELECT on
+// the real pad ends the replay. Returns 0 when not replaying.
+static u8 replayPad(SceCtrlData* const pad) {
+    if(!REPLAY) {
+        return 0;
+    }
+    SceCtrlData real;
+    sceCtrlPeekBufferPositive(&real, 1);
+    if(!replayTime) {
+        replayTime = sceKernelGetSystemTimeLow();
+    }
+    if(chunkIndex == chunkCount) {
+        const int n = sceIoRead(replayFd, chunk, sizeof(chunk));
+        chunkCount = n > 0 ? n / sizeof(SceCtrlData) : 0;
+        chunkIndex = 0;
+    }
+    if(chunkIndex == chunkCount || (real.Buttons & PSP_CTRL_SELECT)) {
+        pad->Buttons = PSP_CTRL_SELECT;
+    } else *pad = chunk[chunkIndex++];
+    return 1;
+}
+
+static void recordPad(const SceCtrlData* const pad) {
+    if(RECORD) {
+        chunk[chunkCount++] = *pad;
+        if(chunkCount == REPLAY_CHUNK_COUNT) {
+            sceIoWrite(replayFd, chunk, sizeof(chunk));
+            chunkCount = 0;
+        }
+    }
+}
+
+// Waits for the vblank unless replaying as fast as possible
+static void replayVblank() {
+    if(REPLAY != REPLAY_FAST) {
+        sceDisplayWaitVblankStart();
+    }
+}
+
+// Stores the duration of each replayed frame in the planned time series
+static void replayFrameDone() {
+    if(REPLAY && replayTimes != NULL && replayFrame < replayFrames) {
+        const u32 now = sceKernelGetSystemTimeLow();
+        replayTimes[replayFrame++] = now - replayTime;
+        replayTime = now;
+    }
+}
+
+// Flushes the recording or writes the replay total and time series
+static void closeReplay(const char* const path) {
+    if(RECORD && chunkCount) {
+        sceIoWrite(replayFd, chunk, chunkCount * sizeof(SceCtrlData));
+    }
+    if(replayFd >= 0) {
+        sceIoClose(replayFd);
+    }
+    if(!REPLAY || replayTimes == NULL) {
+        return;
+    }
+    const SceUID log = sceIoOpen(path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(log < 0) {
+        return;
+    }
+    u64 total = 0;
+    u32 i = 0;
+    while(i < replayFrame) {
+        total += replayTimes[i++];
+    }
+    char line[64];
+    int n = snprintf(line, sizeof(line), "%s: %u frames in %llu us\n",
+        REPLAY == REPLAY_FAST ? "fast" : "vblank", replayFrame, total);
+    sceIoWrite(log, line, n);
+    i = 0;
+    while(i < replayFrame) {
+        n = snprintf(line, sizeof(line), "%u\n", replayTimes[i++]);
+        sceIoWrite(log, line, n);
+    }
+    sceIoClose(log);
+}
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * APoV Project layout seek report
+ * Replays typical navigation patterns over a capture and reports, for its
+ * own layout and the alternative ones apov-transcode -b can write, the mean
+ * seek distance and the sequential reads. The patterns are then read from
+ * the capture file itself with a cold page cache to measure the throughput.
+ * With -p the patterns are also read at the frame size of each format, to
+ * know the frames per second the storage could feed before transcoding.
+ */
+
+#include "apov.h"
+#include <getopt.h>
+
+typedef struct Layout {
+    const char* name;
+    u32 povBlock;
+    u32 depthBlock;
+} Layout;
+
+#define LAYOUTS_COUNT 4
+#define PATTERNS_COUNT 4
+static const char* const PATTERN_NAMES[PATTERNS_COUNT] = { "depth", "rotate", "mixed", "random" };
+
+// Color map size of the probed 1bcm frames, the apov-transcode default
+#define PROBE_MAP_SIZE 8
+
+typedef struct Cursor {
+    int move;
+    int hrotate;
+    int vrotate;
+    u32 seed;
+    u32 held;
+    u8 action;
+} Cursor;
+
+// Largest divisor of count not above limit
+static u32 getBlock(const u32 count, const u32 limit) {
+    u32 block = limit < count ? limit : count;
+    while(count % block) {
+        block--;
+    }
+    return block;
+}
+
+static int wrap(const int value, const int max) {
+    return value < 0 ? max - 1 : (value >= max ? 0 : value);
+}
+
+// Moves the cursor to the next frame of the pattern, as the navigators
+// controls() would: depth sweeps every depth of a POV then turns, rotate
+// turns around at a depth then steps it, mixed holds a random button for a
+// few frames at a time, random jumps anywhere
+static void step(const Capture* const c, const u8 pattern, Cursor* const k) {
+    const int depths = c->DEPTH_FRAME_COUNT;
+    if(pattern == 0) {
+        if(++k->move == depths) {
+            k->move = 0;
+            k->hrotate = wrap(k->hrotate + 1, c->HORIZONTAL_POV_COUNT);
+            if(!k->hrotate) {
+                k->vrotate = wrap(k->vrotate + 1, c->VERTICAL_POV_COUNT);
+            }
+        }
+    } else if(pattern == 1) {
+        k->hrotate = wrap(k->hrotate + 1, c->HORIZONTAL_POV_COUNT);
+        if(!k->hrotate) {
+            k->vrotate = wrap(k->vrotate + 1, c->VERTICAL_POV_COUNT);
+            if(!k->vrotate) {
+                k->move = wrap(k->move + 1, depths);
+            }
+        }
+    } else if(pattern == 2) {
+        if(!k->held) {
+            k->seed = k->seed * 1103515245 + 12345;
+            k->action = (k->seed >> 16) % 6;
+            k->held = 4 + (k->seed >> 8) % 12;
+        }
+        k->held--;
+        switch(k->action) {
+            case 0: k->move = k->move + 1 < depths ? k->move + 1 : k->move; break;
+            case 1: k->move = k->move ? k->move - 1 : 0; break;
+            case 2: k->hrotate = wrap(k->hrotate + 1, c->HORIZONTAL_POV_COUNT); break;
+            case 3: k->hrotate = wrap(k->hrotate - 1, c->HORIZONTAL_POV_COUNT); break;
+            case 4: k->vrotate = wrap(k->vrotate + 1, c->VERTICAL_POV_COUNT); break;
+            default: k->vrotate = wrap(k->vrotate - 1, c->VERTICAL_POV_COUNT); break;
+        }
+    } else {
+        k->seed = k->seed * 1103515245 + 12345;
+        const u32 pov = (k->seed >> 8) % c->POV_COUNT;
+        k->move = (k->seed >> 16) % depths;
+        k->hrotate = pov / c->VERTICAL_POV_COUNT;
+        k->vrotate = pov % c->VERTICAL_POV_COUNT;
+    }
+}
+
+static u64 getLayoutOffset(const Capture* const c, const Layout* const l, const Cursor* const k) {
+    return c->HEADER_SIZE + c->FRAME_BYTES_COUNT * getFrameIndex(c->POV_COUNT, c->DEPTH_FRAME_COUNT,
+        l->povBlock, l->depthBlock, k->hrotate * c->VERTICAL_POV_COUNT + k->vrotate, k->move);
+}
+
+// Mean distance between the end of a read and the start of the next one,
+// and the part of the reads starting where the previous one ended
+static void getSeeks(const Capture* const c, const Layout* const l, const u8 pattern,
+    const u32 count, double* const distance, double* const sequential) {
+    Cursor k = {0};
+    k.seed = 1;
+    u64 total = 0;
+    u32 contiguous = 0;
+    u64 end = getLayoutOffset(c, l, &k) + c->FRAME_BYTES_COUNT;
+    u32 i = 1;
+    while(i < count) {
+        step(c, pattern, &k);
+        const u64 offset = getLayoutOffset(c, l, &k);
+        const u64 seek = offset > end ? offset - end : end - offset;
+        total += seek;
+        contiguous += !seek;
+        end = offset + c->FRAME_BYTES_COUNT;
+        i++;
+    }
+    *distance = count > 1 ? (double)total / (count - 1) : 0.0;
+    *sequential = count > 1 ? (double)contiguous / (count - 1) : 1.0;
+}
+
+static void dropCache(const Capture* const c) {
+    u32 shard = 0;
+    while(shard < c->SHARDS_COUNT) {
+        fdatasync(c->shardFds[shard]);
+        posix_fadvise(c->shardFds[shard++], 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+// Reads the pattern from the capture file after dropping it from the page
+// cache, returns MB/s or a negative value on a short read
+static double getThroughput(const Capture* const c, const u8 pattern, const u32 count, u8* const frame) {
+    dropCache(c);
+    Cursor k = {0};
+    k.seed = 1;
+    const double start = getSeconds();
+    u32 i = 0;
+    while(i < count) {
+        if(readFrame(c, frame, getOffset(c, k.move, k.hrotate, k.vrotate))) {
+            return -1.0;
+        }
+        step(c, pattern, &k);
+        i++;
+    }
+    const double elapsed = getSeconds() - start;
+    return (double)count * c->FRAME_BYTES_COUNT / (elapsed * 1e6);
+}
+
+// Reads nbytes at an offset of the whole capture, across shards
+static int readSpan(const Capture* const c, u8* const data, const u32 nbytes, const u64 offset) {
+    u32 done = 0;
+    while(done < nbytes) {
+        const u64 at = offset + done;
+        u32 i = 0;
+        while(i < c->SHARDS_COUNT - 1 && at >= c->shardEnds[i]) {
+            i++;
+        }
+        const u64 left = c->shardEnds[i] - at;
+        const u32 n = left < nbytes - done ? left : nbytes - done;
+        if(transfer(c->shardFds[i], data + done, n, at - (i ? c->shardEnds[i - 1] : 0), 0)) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Reads the pattern at frames of nbytes, at the offsets getOffset gives for
+// that size, wrapping past the end of the capture data. Returns the frames
+// per second from a cold page cache, or a negative value on a short read.
+static double getProbeRate(const Capture* const c, const u8 pattern, const u32 count,
+    const u64 start, const u64 span, const u32 nbytes, u8* const frame) {
+    const u64 fit = span / nbytes;
+    dropCache(c);
+    Cursor k = {0};
+    k.seed = 1;
+    const double begin = getSeconds();
+    u32 i = 0;
+    while(i < count) {
+        const u64 index = getCaptureIndex(c, k.move, k.hrotate, k.vrotate) % fit;
+        if(readSpan(c, frame, nbytes, start + index * nbytes)) {
+            return -1.0;
+        }
+        step(c, pattern, &k);
+        i++;
+    }
+    return count / (getSeconds() - begin);
+}
+
+// Frames per second of every pattern at the frame size of each format, with
+// the options of the capture. Sizes above the capture data are skipped.
+static int probe(const Capture* const c, const u32 count) {
+    const u32 total = c->POV_COUNT * c->DEPTH_FRAME_COUNT;
+    const u64 start = c->frameOffsets != NULL ? c->frameOffsets[0] : c->HEADER_SIZE;
+    const u64 span = c->frameOffsets != NULL ? c->frameOffsets[total] - start :
+        (u64)(c->frameSlots != NULL ? c->slotsCount : total) * c->FRAME_BYTES_COUNT;
+    Capture formats[FORMATS_COUNT];
+    u32 largest = 0;
+    u8 f = 0;
+    while(f < FORMATS_COUNT) {
+        formats[f] = *c;
+        formats[f].FORMAT = f;
+        formats[f].COLOR_MAP_SIZE = c->FORMAT == FORMAT_1BCM ? c->COLOR_MAP_SIZE : PROBE_MAP_SIZE;
+        setGeometry(&formats[f]);
+        largest = formats[f].FRAME_BYTES_COUNT > largest ? formats[f].FRAME_BYTES_COUNT : largest;
+        f++;
+    }
+
+    printf("Probe, %u frames per pattern from a cold cache:\n", count);
+    printf("%-6s %10s", "format", "frame B");
+    u8 pattern = 0;
+    while(pattern < PATTERNS_COUNT) {
+        printf(" %8s fps", PATTERN_NAMES[pattern++]);
+    }
+    printf(" %12s\n", "worst ms");
+    u8* const frame = malloc(largest);
+    int err = 0;
+    f = 0;
+    while(f < FORMATS_COUNT && !err) {
+        const u32 nbytes = formats[f].FRAME_BYTES_COUNT;
+        printf("%-6s %10u", FORMAT_NAMES[f], nbytes);
+        if(nbytes > span) {
+            printf(" larger than the capture data\n");
+            f++;
+            continue;
+        }
+        double worst = 0.0;
+        pattern = 0;
+        while(pattern < PATTERNS_COUNT) {
+            const double rate = getProbeRate(c, pattern, count, start, span, nbytes, frame);
+            if(rate < 0.0) {
+                fprintf(stderr, "\nShort read in the %s pattern\n", PATTERN_NAMES[pattern]);
+                err = 1;
+                break;
+            }
+            worst = !pattern || 1000.0 / rate > worst ? 1000.0 / rate : worst;
+            printf(" %12.0f", rate);
+            pattern++;
+        }
+        if(!err) {
+            printf(" %12.3f\n", worst);
+        }
+        f++;
+    }
+    free(frame);
+    return err;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: apov-seek [options] DIR\n"
+        "  -f FORMAT  raw, clut or 1bcm (default raw)\n"
+        "  -n COUNT   frames per pattern (default: every frame of the capture)\n"
+        "  -q         only report the seeks, skip the cold cache reads\n"
+        "  -p         also read the patterns at the frame size of each format\n"
+        "DIR holds the capture and its options, as on the memory stick.\n");
+}
+
+int main(int argc, char** argv) {
+    u8 format = FORMAT_RAW;
+    u32 count = 0;
+    u8 quick = 0;
+    u8 probing = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "f:n:qph")) != -1) {
+        int v;
+        switch(opt) {
+            case 'f':
+                if((v = getFormat(optarg)) < 0) {
+                    usage();
+                    return 1;
+                }
+                format = v;
+                break;
+            case 'n': count = atol(optarg); break;
+            case 'q': quick = 1; break;
+            case 'p': probing = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    Capture capture;
+    const Capture* const c = &capture;
+    if(openCapture(&capture, argv[optind], format)) {
+        fprintf(stderr, "Unable to open the %s capture in %s\n", FORMAT_NAMES[format], argv[optind]);
+        closeCapture(&capture);
+        return 1;
+    }
+    if(!count) {
+        count = c->POV_COUNT * c->DEPTH_FRAME_COUNT;
+    }
+
+    const Layout layouts[LAYOUTS_COUNT] = {
+        { "capture", c->POV_BLOCK, c->DEPTH_BLOCK },
+        { "pov major", 1, c->DEPTH_FRAME_COUNT },
+        { "depth major", c->POV_COUNT, 1 },
+        { "blocked", getBlock(c->POV_COUNT, 4), getBlock(c->DEPTH_FRAME_COUNT, 4) }
+    };
+
+    printf("%u POVs x %u depths, %u bytes per frame, %u frames per pattern\n",
+        c->POV_COUNT, c->DEPTH_FRAME_COUNT, c->FRAME_BYTES_COUNT, count);
+    printf("%-12s %-7s %12s %8s %14s\n", "layout", "blocks", "pattern", "seq", "mean seek KB");
+    u8 l = 0;
+    while(l < LAYOUTS_COUNT) {
+        char blocks[32];
+        snprintf(blocks, sizeof(blocks), "%u:%u", layouts[l].povBlock, layouts[l].depthBlock);
+        u8 pattern = 0;
+        while(pattern < PATTERNS_COUNT) {
+            double distance, sequential;
+            getSeeks(c, &layouts[l], pattern, count, &distance, &sequential);
+            printf("%-12s %-7s %12s %7.1f%% %14.1f\n", layouts[l].name, blocks,
+                PATTERN_NAMES[pattern], sequential * 100.0, distance / 1024.0);
+            pattern++;
+        }
+        l++;
+    }
+
+    int err = 0;
+    if(!quick) {
+        u8* const frame = malloc(c->FRAME_BYTES_COUNT);
+        u8 pattern = 0;
+        while(pattern < PATTERNS_COUNT) {
+            const double throughput = getThroughput(c, pattern, count, frame);
+            if(throughput < 0.0) {
+                fprintf(stderr, "Short read in the %s pattern\n", PATTERN_NAMES[pattern]);
+                err = 1;
+                break;
+            }
+            printf("Cold %s reads: %.1f MB/s\n", PATTERN_NAMES[pattern], throughput);
+            pattern++;
+        }
+        free(frame);
+    }
+    if(!err && probing) {
+        err = probe(c, count);
+    }
+
+    closeCapture(&capture);
+    return err;
+}
@@ -0,0 +1,135 @@
+/*
+ * APoV Project
+ * Captures split in several files, addressed as the single file they replace
+ */
+
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include "files.h"
+
+#define SHARD_NAME_BYTES_COUNT 32
+
+// The shards of shards.txt (see files.h) are addressed by their byte range
+// in the single file. Every shard is opened up front so crossing one never waits on an
+// open. When the system runs out of handles, the shards left are opened on
+// demand in place of the least recently used one. Reads crossing the end of
+// a shard continue in the next one. Without the manifest the capture is one
+// shard covering every offset.
+typedef struct Shard {
+    char name[SHARD_NAME_BYTES_COUNT];
+    u64 start;
+    u64 end;
+    SceUID fd;
+    u32 used;
+} Shard;
+
+static Shard shards[SHARDS_COUNT_MAX];
+static u8 SHARDS_COUNT = 0;
+static u8 shardsOpen = 0;
+static u8 lastShard = 0;
+static u32 shardsClock = 0;
+
+static void loadShards(const char* const name) {
+    FILE* const f = fopen(SHARDS_FILE, "r");
+    if(f != NULL) {
+        char line[96];
+        while(SHARDS_COUNT < SHARDS_COUNT_MAX && fgets(line, sizeof(line), f) != NULL) {
+            Shard* const s = &shards[SHARDS_COUNT];
+            if(sscanf(line, "%31s %llu %llu", s->name, &s->start, &s->end) != 3 || s->end <= s->start) {
+                break;
+            }
+            s->fd = -1;
+            SHARDS_COUNT++;
+        }
+        fclose(f);
+    }
+    if(!SHARDS_COUNT) {
+        snprintf(shards[0].name, SHARD_NAME_BYTES_COUNT, "%s", name);
+        shards[0].start = 0;
+        shards[0].end = -1;
+        shards[0].fd = -1;
+        SHARDS_COUNT = 1;
+    }
+}
+
+static SceUID getShardHandle(Shard* const s) {
+    s->used = ++shardsClock;
+    if(s->fd >= 0) {
+        return s->fd;
+    }
+    s->fd = sceIoOpen(s->name, PSP_O_RDONLY, 0777);
+    if(s->fd < 0 && shardsOpen) {
+        Shard* oldest = NULL;
+        u8 i = 0;
+        while(i < SHARDS_COUNT) {
+            if(shards[i].fd >= 0 && (oldest == NULL || shards[i].used < oldest->used)) {
+                oldest = &shards[i];
+            }
+            i++;
+        }
+        sceIoClose(oldest->fd);
+        oldest->fd = -1;
+        shardsOpen--;
+        // The handle may be given to the new shard
+        resetBlocks();
+        s->fd = sceIoOpen(s->name, PSP_O_RDONLY, 0777);
+    }
+    shardsOpen += s->fd >= 0;
+    return s->fd;
+}
+
+static void closeShards() {
+    u8 i = 0;
+    while(i < SHARDS_COUNT) {
+        if(shards[i].fd >= 0) {
+            sceIoClose(shards[i].fd);
+            shards[i].fd = -1;
+        }
+        i++;
+    }
+    shardsOpen = 0;
+    resetBlocks();
+}
+
+// Reads the manifest once, name is the data file of unsplit captures
+static void openShards(const char* const name) {
+    closeShards();
+    if(!SHARDS_COUNT) {
+        loadShards(name);
+    }
+    u8 i = 0;
+    while(i < SHARDS_COUNT) {
+        Shard* const s = &shards[i++];
+        s->fd = sceIoOpen(s->name, PSP_O_RDONLY, 0777);
+        shardsOpen += s->fd >= 0;
+    }
+}
+
+// Reads nbytes at an offset of the whole capture, returns the bytes read
+static int readShards(void* const data, const u64 offset, const u32 nbytes) {
+    u32 done = 0;
+    while(done < nbytes) {
+        const u64 at = offset + done;
+        if(at < shards[lastShard].start || at >= shards[lastShard].end) {
+            lastShard = 0;
+            while(lastShard < SHARDS_COUNT - 1 && at >= shards[lastShard].end) {
+                lastShard++;
+            }
+        }
+        Shard* const s = &shards[lastShard];
+        const SceUID fd = getShardHandle(s);
+        if(fd < 0 || at < s->start) {
+            return done ? (int)done : -1;
+        }
+        const u32 count = s->end - at < nbytes - done ? s->end - at : nbytes - done;
+        const int n = readBlocks(fd, (u8*)data + done, at - s->start, count);
+        done += n > 0 ? n : 0;
+        if(n != count) {
+            break;
+        }
+    }
+    return done;
+}
+
+#endif
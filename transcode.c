@@ -0,0 +1,906 @@
+/*
+ * APoV Project streaming transcoder
+ * Converts a capture between the raw, clut and 1bcm navigator formats,
+ * frame by frame and in parallel across the points of view.
+ */
+
+#include "apov.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+// Colors are quantized from a 15 bits histogram, index 0 stays black for
+// the empty voxels
+#define HISTOGRAM_SIZE 32768
+#define EMPTY_INDEX 0
+#define LOD_LEVELS_COUNT 3
+
+typedef struct Job {
+    Capture* in;
+    Capture out;
+    int fd;
+    int lods[LOD_LEVELS_COUNT];
+    int occupancy;
+    u8 lodCount;
+    u8 pass;
+    u64* histogram;
+    u8 lookup[HISTOGRAM_SIZE];
+    pthread_mutex_t lock;
+    atomic_uint nextPov;
+    atomic_int failed;
+} Job;
+
+typedef struct Bin {
+    u16 color;
+    u32 count;
+} Bin;
+
+static inline u16 getBin(const u32 p) {
+    return ((p >> 3) & 0x1F) | ((p >> 11) & 0x1F) << 5 | ((p >> 19) & 0x1F) << 10;
+}
+
+// Decodes any input frame to raw pixels, depth in the highest byte. Clut and
+// 1bcm frames hold no depth, their pixels get depth 0.
+static void toRaw(const Capture* const c, u8* const frame, u32* const raw) {
+    if(c->FORMAT == FORMAT_RAW) {
+        memcpy(raw, frame, c->WIN_PIXELS_COUNT * sizeof(u32));
+        return;
+    }
+    if(c->FORMAT == FORMAT_CLUT) {
+        getClutView(c, frame, raw);
+    } else get1bcmView(c, frame, raw, 0);
+
+    u32 i = c->WIN_PIXELS_COUNT;
+    while(i--) {
+        raw[i] &= 0x00FFFFFF;
+    }
+}
+
+static void toClut(const Job* const job, const u32* const raw, u8* const frame, const u32 count) {
+    u32 i = count;
+    while(i--) {
+        frame[i] = raw[i] ? job->lookup[getBin(raw[i])] : EMPTY_INDEX;
+    }
+}
+
+static inline u32 getMapPixels(const Capture* const c) {
+    return c->MAP_WIDTH * c->MAP_HEIGHT;
+}
+
+// One bit per visible voxel, then the average color of each map cell. sums
+// holds 4 counters per map cell, allocated by the worker.
+static void to1bcm(const Capture* const c, const u32* const raw, u8* const frame, u32 (* const sums)[4]) {
+    u32* const map = (u32*)&frame[c->WIN_BYTES_COUNT];
+    const u32 MAP_PIXELS_COUNT = getMapPixels(c);
+    memset(sums, 0, MAP_PIXELS_COUNT * sizeof(*sums));
+    memset(frame, 0, c->WIN_BYTES_COUNT);
+
+    u32 i = c->WIN_PIXELS_COUNT;
+    while(i--) {
+        const u32 p = raw[i];
+        if(p) {
+            const u16 x = i % c->WIN_WIDTH;
+            const u16 y = i / c->WIN_WIDTH;
+            u32* const sum = sums[(x / c->MAP_WIDTH_SCALE) + (y / c->MAP_HEIGHT_SCALE) * c->MAP_WIDTH];
+            frame[i / 8] |= 0b1 << (i % 8);
+            sum[0] += p & 0xFF;
+            sum[1] += (p >> 8) & 0xFF;
+            sum[2] += (p >> 16) & 0xFF;
+            sum[3]++;
+        }
+    }
+
+    i = MAP_PIXELS_COUNT;
+    while(i--) {
+        const u32* const sum = sums[i];
+        map[i] = sum[3] ? (sum[0] / sum[3]) | (sum[1] / sum[3]) << 8 | (sum[2] / sum[3]) << 16 : 0;
+    }
+}
+
+static int writeFrame(const Job* const job, u8* const frame, const u64 offset) {
+    return transferFrame(&job->out, job->fd, frame, offset, 1);
+}
+
+// Halves a row major raw frame, averaging the visible voxels of each 2x2
+// block, depth included
+static void toHalf(const u32* const raw, u32* const half, const u16 width, const u16 height) {
+    const u16 w = width / 2;
+    u32 i = w * (height / 2);
+    while(i--) {
+        const u32* const p = &raw[(i % w) * 2 + (i / w) * 2 * width];
+        const u32 block[4] = {p[0], p[1], p[width], p[width + 1]};
+        u32 sum[4] = {0};
+        u8 n = 0;
+        u8 k = 4;
+        while(k--) {
+            if(block[k]) {
+                u8 ch = 4;
+                while(ch--) {
+                    sum[ch] += (block[k] >> (ch * 8)) & 0xFF;
+                }
+                n++;
+            }
+        }
+        half[i] = n ? (sum[0] / n) | (sum[1] / n) << 8 | (sum[2] / n) << 16 | (sum[3] / n) << 24 : 0;
+    }
+}
+
+// LOD frames are stored as contiguous tiles of (256 >> level) texels, the
+// layout the navigators read them into
+static void toTiles(const u8* const frame, u8* const tiles, const u16 width, const u16 height,
+    const u16 size, const u8 texel) {
+    const u32 nbytes = size * texel;
+    u16 tile = width / size;
+    while(tile--) {
+        u16 y = height;
+        while(y--) {
+            memcpy(&tiles[(tile * height + y) * nbytes], &frame[(y * width + tile * size) * texel], nbytes);
+        }
+    }
+}
+
+static int writeLods(const Job* const job, const u32* const raw, u32* const lod, u8* const tiles,
+    const u64 index) {
+    const Capture* const out = &job->out;
+    const u32* source = raw;
+    u16 width = out->WIN_WIDTH;
+    u16 height = out->WIN_HEIGHT;
+    u8 level = 1;
+    while(level < job->lodCount) {
+        u32* const half = &lod[level == 1 ? 0 : out->WIN_PIXELS_COUNT / 4];
+        toHalf(source, half, width, height);
+        width /= 2;
+        height /= 2;
+        const u32 count = width * height;
+        const u8 texel = out->FORMAT == FORMAT_CLUT ? sizeof(u8) : sizeof(u32);
+        u8* frame = (u8*)half;
+        if(out->FORMAT == FORMAT_CLUT) {
+            frame = &tiles[count];
+            toClut(job, half, frame, count);
+        }
+        toTiles(frame, tiles, width, height, TEXTURE_BLOCK_SIZE >> level, texel);
+        if(transfer(job->lods[level], tiles, count * texel, index * count * texel, 1)) {
+            return -1;
+        }
+        source = half;
+        level++;
+    }
+    return 0;
+}
+
+static void* transcodePovs(void* const arg) {
+    Job* const job = arg;
+    const Capture* const in = job->in;
+    const Capture* const out = &job->out;
+
+    u8* const frame = malloc(in->FRAME_BYTES_COUNT);
+    u32* const raw = malloc(in->WIN_PIXELS_COUNT * sizeof(u32));
+    u8* const encoded = malloc(out->FRAME_BYTES_COUNT);
+    u32* const lod = job->lodCount > 1 ? malloc(out->WIN_PIXELS_COUNT * sizeof(u32) / 2) : NULL;
+    u8* const tiles = job->lodCount > 1 ? malloc(out->WIN_PIXELS_COUNT * sizeof(u32) / 2) : NULL;
+    u64* const histogram = job->pass ? NULL : calloc(HISTOGRAM_SIZE, sizeof(u64));
+    u8* const record = malloc(getOccupancyBytes(out));
+    u32 (* const sums)[4] = out->FORMAT == FORMAT_1BCM ? malloc(getMapPixels(out) * sizeof(*sums)) : NULL;
+    if(frame == NULL || raw == NULL || encoded == NULL || record == NULL ||
+        (job->lodCount > 1 && (lod == NULL || tiles == NULL)) || (!job->pass && histogram == NULL) ||
+        (out->FORMAT == FORMAT_1BCM && sums == NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        job->failed = 1;
+    }
+
+    u32 pov;
+    while(!job->failed && (pov = atomic_fetch_add(&job->nextPov, 1)) < in->POV_COUNT) {
+        const int hrotate = pov / in->VERTICAL_POV_COUNT;
+        const int vrotate = pov % in->VERTICAL_POV_COUNT;
+        u32 move = 0;
+        while(move < in->DEPTH_FRAME_COUNT) {
+            if(readFrame(in, frame, getOffset(in, move, hrotate, vrotate))) {
+                fprintf(stderr, "Short read at pov %u, move %u\n", pov, move);
+                job->failed = 1;
+                break;
+            }
+            toRaw(in, frame, raw);
+
+            if(histogram) {
+                u32 i = in->WIN_PIXELS_COUNT;
+                while(i--) {
+                    if(raw[i]) {
+                        histogram[getBin(raw[i])]++;
+                    }
+                }
+            } else {
+                if(out->FORMAT == FORMAT_RAW) {
+                    memcpy(encoded, raw, out->FRAME_BYTES_COUNT);
+                } else if(out->FORMAT == FORMAT_CLUT) {
+                    toClut(job, raw, encoded, out->WIN_PIXELS_COUNT);
+                } else to1bcm(out, raw, encoded, sums);
+
+                const u64 index = getCaptureIndex(out, move, hrotate, vrotate);
+                if(job->occupancy >= 0) {
+                    getOccupancy(out, raw, record);
+                }
+                if(writeFrame(job, encoded, getOffset(out, move, hrotate, vrotate)) ||
+                    (lod && writeLods(job, raw, lod, tiles, index)) ||
+                    (job->occupancy >= 0 && transfer(job->occupancy, record, getOccupancyBytes(out),
+                        index * getOccupancyBytes(out), 1))) {
+                    fprintf(stderr, "Write failed at pov %u, move %u\n", pov, move);
+                    job->failed = 1;
+                    break;
+                }
+            }
+            move++;
+        }
+    }
+
+    if(histogram) {
+        pthread_mutex_lock(&job->lock);
+        u32 i = HISTOGRAM_SIZE;
+        while(i--) {
+            job->histogram[i] += histogram[i];
+        }
+        pthread_mutex_unlock(&job->lock);
+        free(histogram);
+    }
+    free(frame);
+    free(raw);
+    free(encoded);
+    free(lod);
+    free(tiles);
+    free(record);
+    free(sums);
+    return NULL;
+}
+
+static int runPass(Job* const job, const long threads, const u8 pass) {
+    pthread_t workers[threads];
+    job->pass = pass;
+    job->nextPov = 0;
+    long i = 0;
+    while(i < threads) {
+        pthread_create(&workers[i++], NULL, transcodePovs, job);
+    }
+    while(i--) {
+        pthread_join(workers[i], NULL);
+    }
+    return job->failed;
+}
+
+static u8 getChannel(const u16 color, const u8 channel) {
+    return (color >> (channel * 5)) & 0x1F;
+}
+
+static int compareChannel;
+static int compareBins(const void* const a, const void* const b) {
+    return getChannel(((const Bin*)a)->color, compareChannel) -
+        getChannel(((const Bin*)b)->color, compareChannel);
+}
+
+// Median cut over the histogram bins, then nearest color lookup per bin
+static void quantize(Job* const job, u32* const clut) {
+    Bin* const bins = malloc(HISTOGRAM_SIZE * sizeof(Bin));
+    u32 count = 0;
+    u32 i = 0;
+    while(i < HISTOGRAM_SIZE) {
+        if(job->histogram[i]) {
+            bins[count].color = i;
+            bins[count].count = job->histogram[i] > 0xFFFFFFFF ? 0xFFFFFFFF : job->histogram[i];
+            count++;
+        }
+        i++;
+    }
+
+    u32 first[CLUT_COLOR_COUNT] = {0};
+    u32 last[CLUT_COLOR_COUNT] = {count};
+    u16 boxes = count ? 1 : 0;
+    while(boxes < CLUT_COLOR_COUNT - 1) {
+        u16 box = 0;
+        u8 channel = 0;
+        u64 best = 0;
+        u16 b = boxes;
+        while(b--) {
+            if(last[b] - first[b] < 2) {
+                continue;
+            }
+            u8 ch = 3;
+            while(ch--) {
+                u8 min = 0x1F, max = 0;
+                u64 weight = 0;
+                u32 n = first[b];
+                while(n < last[b]) {
+                    const u8 v = getChannel(bins[n].color, ch);
+                    min = v < min ? v : min;
+                    max = v > max ? v : max;
+                    weight += bins[n].count;
+                    n++;
+                }
+                const u64 score = (u64)(max - min) * weight;
+                if(score > best) {
+                    best = score;
+                    box = b;
+                    channel = ch;
+                }
+            }
+        }
+        if(!best) {
+            break;
+        }
+        compareChannel = channel;
+        qsort(&bins[first[box]], last[box] - first[box], sizeof(Bin), compareBins);
+
+        u64 total = 0, half = 0;
+        u32 n = first[box];
+        while(n < last[box]) {
+            total += bins[n++].count;
+        }
+        u32 median = first[box];
+        while(median < last[box] - 1 && (half += bins[median].count) < total / 2) {
+            median++;
+        }
+        median = median == first[box] ? median + 1 : median;
+        first[boxes] = median;
+        last[boxes] = last[box];
+        last[box] = median;
+        boxes++;
+    }
+
+    clut[EMPTY_INDEX] = 0xFF000000;
+    u16 b = 0;
+    while(b < boxes) {
+        u64 sum[3] = {0}, weight = 0;
+        u32 n = first[b];
+        while(n < last[b]) {
+            u8 ch = 3;
+            while(ch--) {
+                sum[ch] += (u64)((getChannel(bins[n].color, ch) << 3) | 4) * bins[n].count;
+            }
+            weight += bins[n].count;
+            n++;
+        }
+        clut[b + 1] = 0xFF000000 |
+            (u32)(sum[0] / weight) | (u32)(sum[1] / weight) << 8 | (u32)(sum[2] / weight) << 16;
+        b++;
+    }
+    while(++b < CLUT_COLOR_COUNT) {
+        clut[b] = 0xFF000000;
+    }
+
+    i = HISTOGRAM_SIZE;
+    while(i--) {
+        u32 best = 0xFFFFFFFF;
+        u16 c = boxes;
+        while(c--) {
+            const u32 p = clut[c + 1];
+            const int dr = (int)((getChannel(i, 0) << 3) | 4) - (int)(p & 0xFF);
+            const int dg = (int)((getChannel(i, 1) << 3) | 4) - (int)((p >> 8) & 0xFF);
+            const int db = (int)((getChannel(i, 2) << 3) | 4) - (int)((p >> 16) & 0xFF);
+            const u32 d = dr * dr + dg * dg + db * db;
+            if(d < best) {
+                best = d;
+                job->lookup[i] = c + 1;
+            }
+        }
+    }
+    free(bins);
+    printf("Palette: %u colors from %u histogram bins\n", boxes, count);
+}
+
+static FILE* createOut(const char* const dir, const char* const name) {
+    return openIn(dir, name, "wb");
+}
+
+static int writeOptions(const Job* const job, const char* const dir, const u32* const clut) {
+    const Capture* const out = &job->out;
+    FILE* f;
+    if(out->FORMAT == FORMAT_1BCM) {
+        u8 header[HEADER_BYTES_COUNT] = {0};
+        const Options options = {
+            TEXTURE_BLOCK_SIZE,
+            out->HORIZONTAL_POV_COUNT,
+            out->VERTICAL_POV_COUNT,
+            out->RAY_STEP,
+            out->WIDTH_BLOCK_COUNT,
+            out->DEPTH_BLOCK_COUNT,
+            out->COLOR_MAP_SIZE,
+            out->TRACE_EDGES,
+            out->POV_BLOCK,
+            out->DEPTH_BLOCK
+        };
+        memcpy(header, &options, sizeof(Options));
+        return pwrite(job->fd, header, HEADER_BYTES_COUNT, 0) == HEADER_BYTES_COUNT ? 0 : -1;
+    }
+
+    if(!(f = createOut(dir, "options.txt"))) {
+        return -1;
+    }
+    if(out->FORMAT == FORMAT_RAW) {
+        fprintf(f, "MPDEPTH:%.1f HPOV:%u VPOV:%u RAYSTEP:%u WBCOUNT:%u DBCOUNT:%u",
+            out->MAX_PROJECTION_DEPTH, out->HORIZONTAL_POV_COUNT, out->VERTICAL_POV_COUNT,
+            out->RAY_STEP, out->WIDTH_BLOCK_COUNT, out->DEPTH_BLOCK_COUNT);
+    } else {
+        fprintf(f, "HPOV:%u VPOV:%u RAYSTEP:%u WBCOUNT:%u DBCOUNT:%u",
+            out->HORIZONTAL_POV_COUNT, out->VERTICAL_POV_COUNT,
+            out->RAY_STEP, out->WIDTH_BLOCK_COUNT, out->DEPTH_BLOCK_COUNT);
+    }
+    if(out->POV_BLOCK != 1 || out->DEPTH_BLOCK != out->DEPTH_FRAME_COUNT) {
+        fprintf(f, " POVBLOCK:%u DEPTHBLOCK:%u", out->POV_BLOCK, out->DEPTH_BLOCK);
+    }
+    fprintf(f, out->TILED ? " TILED:1\n" : "\n");
+    if(fclose(f)) {
+        return -1;
+    }
+
+    if(out->FORMAT == FORMAT_CLUT) {
+        if(!(f = createOut(dir, "clut.bin"))) {
+            return -1;
+        }
+        const size_t n = fwrite(clut, sizeof(u32), CLUT_COLOR_COUNT, f);
+        if(fclose(f) || n != CLUT_COLOR_COUNT) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Rewrites the 1bcm data in layout order with run length coded masks, the
+// frame offsets following the header. Returns the packed size, 0 on failure.
+static u64 packMasks(const Capture* const out, const char* const path) {
+    char packedPath[4096 + 8];
+    snprintf(packedPath, sizeof(packedPath), "%s.runs", path);
+    const int in = open(path, O_RDONLY);
+    const int fd = open(packedPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    const u32 frames = out->POV_COUNT * out->DEPTH_FRAME_COUNT;
+    const u32 maxRuns = out->WIN_BYTES_COUNT / sizeof(u16) - 1;
+    u32* const offsets = malloc((frames + 1) * sizeof(u32));
+    u8* const frame = malloc(out->FRAME_BYTES_COUNT);
+    u16* const runs = malloc((maxRuns + 1) * sizeof(u16));
+    u8 header[HEADER_BYTES_COUNT];
+    u64 offset = HEADER_BYTES_COUNT + (u64)(frames + 1) * sizeof(u32);
+    u32 coded = 0;
+    int err = in < 0 || fd < 0 || transfer(in, header, HEADER_BYTES_COUNT, 0, 0);
+    if(!err) {
+        ((Options*)header)->MASK_RUNS = 1;
+        err = transfer(fd, header, HEADER_BYTES_COUNT, 0, 1);
+    }
+
+    u32 i = 0;
+    while(!err && i < frames) {
+        err = transfer(in, frame, out->FRAME_BYTES_COUNT,
+            HEADER_BYTES_COUNT + (u64)i * out->FRAME_BYTES_COUNT, 0);
+        const u32 count = getMaskRuns(frame, out->WIN_PIXELS_COUNT, runs, maxRuns);
+        u8* const mask = count <= maxRuns ? (u8*)runs : frame;
+        const u32 nbytes = count <= maxRuns ? count * sizeof(u16) : out->WIN_BYTES_COUNT;
+        coded += count <= maxRuns;
+        offsets[i++] = offset;
+        err = err || offset + out->FRAME_BYTES_COUNT > 0xFFFFFFFF ||
+            transfer(fd, &frame[out->WIN_BYTES_COUNT], out->MAP_BYTES_COUNT, offset, 1) ||
+            transfer(fd, mask, nbytes, offset + out->MAP_BYTES_COUNT, 1);
+        offset += out->MAP_BYTES_COUNT + nbytes;
+    }
+    offsets[frames] = offset;
+    err = err || transfer(fd, (u8*)offsets, (frames + 1) * sizeof(u32), HEADER_BYTES_COUNT, 1);
+
+    if(in >= 0) {
+        close(in);
+    }
+    if(fd >= 0 && close(fd)) {
+        err = 1;
+    }
+    free(offsets);
+    free(frame);
+    free(runs);
+    if(err || rename(packedPath, path)) {
+        unlink(packedPath);
+        return 0;
+    }
+    printf("Masks: %u of %u frames run length coded\n", coded, frames);
+    return offset;
+}
+
+static u64 hashFrame(const u8* const frame, const u32 nbytes) {
+    u64 hash = 0xCBF29CE484222325ULL;
+    u32 i = 0;
+    while(i < nbytes) {
+        hash = (hash ^ frame[i++]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static u8 isFrameEmpty(const u8* const frame, const u32 nbytes) {
+    u32 i = nbytes;
+    while(i--) {
+        if(frame[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Moves the record of each slot from the frame it was first seen at, slots
+// never come after their frame so it is done in place
+static int compactRecords(const int fd, const u32 nbytes, const u32* const sources, const u32 count) {
+    u8* const record = malloc(nbytes);
+    int err = fd < 0;
+    u32 slot = 0;
+    while(!err && slot < count) {
+        if(sources[slot] != slot) {
+            err = transfer(fd, record, nbytes, (u64)sources[slot] * nbytes, 0) ||
+                transfer(fd, record, nbytes, (u64)slot * nbytes, 1);
+        }
+        slot++;
+    }
+    free(record);
+    return err || ftruncate(fd, (u64)count * nbytes);
+}
+
+// Stores each distinct frame of the data file once, in the order they are
+// first seen, and drops the empty ones, which decode to no voxel. Frames are
+// matched by their 64 bits FNV-1a hash then compared. dedup.bin gives the
+// slot of every frame in the layout order, the occupancy and reduced frames
+// are compacted to the slots. Returns the slot count, -1 on failure.
+static long dedupFrames(const Job* const job, const char* const dir) {
+    const Capture* const out = &job->out;
+    const u32 frames = out->POV_COUNT * out->DEPTH_FRAME_COUNT;
+    const u32 nbytes = out->FRAME_BYTES_COUNT;
+    // A 1bcm frame with an empty mask is empty whatever its color map
+    const u32 maskBytes = out->FORMAT == FORMAT_1BCM ? out->WIN_BYTES_COUNT : nbytes;
+    u32 tableSize = 1;
+    while(tableSize < frames * 2) {
+        tableSize <<= 1;
+    }
+    // Open addressing table of slot + 1, 0 is free
+    u32* const table = calloc(tableSize, sizeof(u32));
+    u64* const hashes = malloc(frames * sizeof(u64));
+    u32* const sources = malloc(frames * sizeof(u32));
+    u32* const slots = malloc((frames + 1) * sizeof(u32));
+    u8* const frame = malloc(nbytes);
+    u8* const match = malloc(nbytes);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, getDataName(out->FORMAT));
+    const int fd = open(path, O_RDWR);
+    u32 count = 0;
+    u32 empty = 0;
+    int err = fd < 0;
+
+    u32 i = 0;
+    while(!err && i < frames) {
+        err = transfer(fd, frame, nbytes, out->HEADER_SIZE + (u64)i * nbytes, 0);
+        if(isFrameEmpty(frame, maskBytes)) {
+            slots[1 + i++] = DEDUP_EMPTY;
+            empty++;
+            continue;
+        }
+        const u64 hash = hashFrame(frame, nbytes);
+        u32 h = hash & (tableSize - 1);
+        u32 slot = DEDUP_EMPTY;
+        while(!err && table[h]) {
+            const u32 s = table[h] - 1;
+            if(hashes[s] == hash) {
+                err = transfer(fd, match, nbytes, out->HEADER_SIZE + (u64)s * nbytes, 0);
+                if(!err && !memcmp(frame, match, nbytes)) {
+                    slot = s;
+                    break;
+                }
+            }
+            h = (h + 1) & (tableSize - 1);
+        }
+        if(!err && slot == DEDUP_EMPTY) {
+            slot = count++;
+            table[h] = slot + 1;
+            hashes[slot] = hash;
+            sources[slot] = i;
+            if(slot != i) {
+                err = transfer(fd, frame, nbytes, out->HEADER_SIZE + (u64)slot * nbytes, 1);
+            }
+        }
+        slots[1 + i++] = slot;
+    }
+    err = err || ftruncate(fd, out->HEADER_SIZE + (u64)count * nbytes);
+    if(fd >= 0 && close(fd)) {
+        err = 1;
+    }
+
+    FILE* f = NULL;
+    slots[0] = count;
+    err = err || !(f = createOut(dir, DEDUP_FILE)) || fwrite(slots, sizeof(u32), frames + 1, f) != frames + 1;
+    if(f && fclose(f)) {
+        err = 1;
+    }
+    if(!err && job->occupancy >= 0) {
+        err = compactRecords(job->occupancy, getOccupancyBytes(out), sources, count);
+    }
+    u8 level = 1;
+    while(!err && level < job->lodCount) {
+        const u8 texel = out->FORMAT == FORMAT_CLUT ? sizeof(u8) : sizeof(u32);
+        err = compactRecords(job->lods[level], (out->WIN_PIXELS_COUNT >> (level * 2)) * texel, sources, count);
+        level++;
+    }
+
+    free(table);
+    free(hashes);
+    free(sources);
+    free(slots);
+    free(frame);
+    free(match);
+    if(err) {
+        return -1;
+    }
+    printf("Dedup: %u of %u frames stored, %u empty, %u duplicates (%.2fx)\n", count, frames, empty,
+        frames - count - empty, count ? (double)frames / count : 0.0);
+    return count;
+}
+
+// Point of view of a frame stored at index in the layout order
+static u32 getFramePov(const Capture* const c, const u64 index) {
+    const u64 group = (u64)c->POV_BLOCK * c->DEPTH_FRAME_COUNT;
+    return (index / group) * c->POV_BLOCK + (index % ((u64)c->POV_BLOCK * c->DEPTH_BLOCK)) / c->DEPTH_BLOCK;
+}
+
+// Moves the frames past limit bytes of the data file to numbered shards and
+// lists them in shards.txt, the data file keeps the header and the first
+// frames. Shards hold whole POV blocks when one fits. Returns 0 on success.
+static int splitShards(const Capture* const out, const char* const dir, const u64 limit) {
+    const u64 frames = (u64)out->POV_COUNT * out->DEPTH_FRAME_COUNT;
+    const u64 group = (u64)out->POV_BLOCK * out->DEPTH_FRAME_COUNT;
+    const u64 unit = group * out->FRAME_BYTES_COUNT + out->HEADER_SIZE <= limit ? group : 1;
+    const u64 perShard = (limit - out->HEADER_SIZE) / out->FRAME_BYTES_COUNT / unit * unit;
+    if(!perShard) {
+        return -1;
+    }
+
+    char path[4096];
+    char name[64];
+    getShardName(out->FORMAT, 0, name, sizeof(name));
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    const int in = open(path, O_RDWR);
+    snprintf(path, sizeof(path), "%s/%s", dir, SHARDS_FILE);
+    FILE* const manifest = fopen(path, "w");
+    u8* const frame = malloc(out->FRAME_BYTES_COUNT);
+    int err = in < 0 || !manifest;
+
+    u64 first = 0;
+    u32 shard = 0;
+    while(!err && first < frames) {
+        const u64 count = frames - first < perShard ? frames - first : perShard;
+        const u64 start = shard ? out->HEADER_SIZE + first * out->FRAME_BYTES_COUNT : 0;
+        const u64 end = out->HEADER_SIZE + (first + count) * out->FRAME_BYTES_COUNT;
+        getShardName(out->FORMAT, shard, name, sizeof(name));
+        fprintf(manifest, "%s %llu %llu %u %u\n", name, (unsigned long long)start,
+            (unsigned long long)end, getFramePov(out, first), getFramePov(out, first + count - 1));
+        if(shard) {
+            snprintf(path, sizeof(path), "%s/%s", dir, name);
+            const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            u64 i = 0;
+            err = fd < 0;
+            while(!err && i < count) {
+                const u64 offset = i * out->FRAME_BYTES_COUNT;
+                err = transfer(in, frame, out->FRAME_BYTES_COUNT, start + offset, 0) ||
+                    transfer(fd, frame, out->FRAME_BYTES_COUNT, offset, 1);
+                i++;
+            }
+            if(fd >= 0 && close(fd)) {
+                err = 1;
+            }
+        }
+        first += count;
+        shard++;
+    }
+    err = err || ftruncate(in, out->HEADER_SIZE + (frames < perShard ? frames : perShard) *
+        out->FRAME_BYTES_COUNT);
+
+    if(in >= 0) {
+        close(in);
+    }
+    if(manifest && fclose(manifest)) {
+        err = 1;
+    }
+    free(frame);
+    if(!err) {
+        printf("Shards: %u of at most %llu MB\n", shard, (unsigned long long)(limit >> 20));
+    }
+    return err ? -1 : 0;
+}
+
+// Whether both paths are the same directory, the output would then replace
+// the data, options and sidecar files of the capture being read
+static u8 isSameDir(const char* const a, const char* const b) {
+    struct stat sa, sb;
+    return !stat(a, &sa) && !stat(b, &sb) && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: apov-transcode [options] IN_DIR OUT_DIR\n"
+        "  -f FORMAT  input format: raw, clut or 1bcm (default raw)\n"
+        "  -t FORMAT  output format: raw, clut or 1bcm (default clut)\n"
+        "  -c SIZE    1bcm: color map size (default 8)\n"
+        "  -e         1bcm: trace edges\n"
+        "  -R         1bcm: run length code the masks\n"
+        "  -T         raw, clut: store frames as 256x256 tiles\n"
+        "  -L         raw, clut: also write half and quarter resolution frames\n"
+        "  -O         write the per frame occupancy used to skip empty space\n"
+        "  -b P:D     store frames by blocks of P POVs x D depths, 0 for all\n"
+        "             (default 1:0 POV major, 0:1 depth major)\n"
+        "  -S MB      split the data in shards of at most MB, listed in\n"
+        "             shards.txt, for memory sticks limited to 4 GB files\n"
+        "  -D         store identical frames once and empty frames not at\n"
+        "             all, referenced by dedup.bin (not with -S or -R)\n"
+        "  -j COUNT   worker threads (default: all cores)\n");
+}
+
+int main(int argc, char** argv) {
+    static Job job;
+    u8 from = FORMAT_RAW;
+    u8 to = FORMAT_CLUT;
+    u32 colorMapSize = 8;
+    u8 traceEdges = 0;
+    u8 tiled = 0;
+    u8 lods = 0;
+    u8 occupancy = 0;
+    u8 maskRuns = 0;
+    u32 povBlock = 1;
+    u32 depthBlock = 0;
+    u64 shardBytes = 0;
+    u8 dedup = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while((opt = getopt(argc, argv, "f:t:c:eRTLOb:S:Dj:h")) != -1) {
+        int v;
+        switch(opt) {
+            case 'f':
+            case 't':
+                if((v = getFormat(optarg)) < 0) {
+                    usage();
+                    return 1;
+                }
+                if(opt == 'f') {
+                    from = v;
+                } else to = v;
+                break;
+            case 'c': colorMapSize = atoi(optarg); break;
+            case 'e': traceEdges = 1; break;
+            case 'T': tiled = 1; break;
+            case 'L': lods = 1; break;
+            case 'O': occupancy = 1; break;
+            case 'R': maskRuns = 1; break;
+            case 'b':
+                if(sscanf(optarg, "%u:%u", &povBlock, &depthBlock) != 2) {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'S': shardBytes = (u64)atol(optarg) << 20; break;
+            case 'D': dedup = 1; break;
+            case 'j': threads = atol(optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if(optind != argc - 2 || threads < 1 ||
+        !colorMapSize || TEXTURE_BLOCK_SIZE % colorMapSize ||
+        shardBytes >= (4ULL << 30) || (shardBytes && maskRuns && to == FORMAT_1BCM) ||
+        (dedup && (shardBytes || (maskRuns && to == FORMAT_1BCM))) || (lods && to == FORMAT_1BCM)) {
+        usage();
+        return 1;
+    }
+    const char* const outDir = argv[optind + 1];
+
+    Capture in;
+    if(openCapture(&in, argv[optind], from)) {
+        fprintf(stderr, "Unable to open the %s capture in %s\n", FORMAT_NAMES[from], argv[optind]);
+        closeCapture(&in);
+        return 1;
+    }
+    if(isSameDir(argv[optind], outDir)) {
+        fprintf(stderr, "%s holds the input capture, choose another output directory\n", outDir);
+        closeCapture(&in);
+        return 1;
+    }
+    // 0 is the whole capture, other blocks must divide it
+    if((povBlock && in.POV_COUNT % povBlock) || (depthBlock && in.DEPTH_FRAME_COUNT % depthBlock)) {
+        fprintf(stderr, "-b %u:%u does not divide the %u POVs x %u depths of the capture\n",
+            povBlock, depthBlock, in.POV_COUNT, in.DEPTH_FRAME_COUNT);
+        usage();
+        closeCapture(&in);
+        return 1;
+    }
+
+    Capture* const out = &job.out;
+    out->FORMAT = to;
+    out->MAX_PROJECTION_DEPTH = in.MAX_PROJECTION_DEPTH;
+    out->HORIZONTAL_POV_COUNT = in.HORIZONTAL_POV_COUNT;
+    out->VERTICAL_POV_COUNT = in.VERTICAL_POV_COUNT;
+    out->RAY_STEP = in.RAY_STEP;
+    out->WIDTH_BLOCK_COUNT = in.WIDTH_BLOCK_COUNT;
+    out->DEPTH_BLOCK_COUNT = in.DEPTH_BLOCK_COUNT;
+    out->COLOR_MAP_SIZE = colorMapSize;
+    out->TRACE_EDGES = traceEdges;
+    out->TILED = tiled && to != FORMAT_1BCM;
+    out->POV_BLOCK = povBlock ? povBlock : in.HORIZONTAL_POV_COUNT * in.VERTICAL_POV_COUNT;
+    out->DEPTH_BLOCK = depthBlock;
+    setGeometry(out);
+
+    job.in = &in;
+    pthread_mutex_init(&job.lock, NULL);
+    if(threads > in.POV_COUNT) {
+        threads = in.POV_COUNT;
+    }
+
+    const double start = getSeconds();
+    u32 clut[CLUT_COLOR_COUNT];
+    if(to == FORMAT_CLUT) {
+        job.histogram = calloc(HISTOGRAM_SIZE, sizeof(u64));
+        if(runPass(&job, threads, 0)) {
+            closeCapture(&in);
+            return 1;
+        }
+        quantize(&job, clut);
+        free(job.histogram);
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", outDir, getDataName(to));
+    job.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    job.occupancy = -1;
+    if(occupancy) {
+        snprintf(path, sizeof(path), "%s/%s", outDir, OCCUPANCY_FILE);
+        job.occupancy = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    job.lodCount = 1;
+    while(lods && job.lodCount < LOD_LEVELS_COUNT) {
+        snprintf(path, sizeof(path), to == FORMAT_CLUT ? "%s/clut-indexes-lod%u.bin" :
+            "%s/atoms-lod%u.apov", outDir, job.lodCount);
+        if((job.lods[job.lodCount] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+            break;
+        }
+        job.lodCount++;
+    }
+    if(job.fd < 0 || (occupancy && job.occupancy < 0) ||
+        runPass(&job, threads, 1) || writeOptions(&job, outDir, clut)) {
+        fprintf(stderr, "Unable to write the %s capture in %s\n", FORMAT_NAMES[to], outDir);
+        closeCapture(&in);
+        return 1;
+    }
+    close(job.fd);
+    const u64 frames = (u64)in.POV_COUNT * in.DEPTH_FRAME_COUNT;
+    long stored = frames;
+    if(dedup && (stored = dedupFrames(&job, outDir)) < 0) {
+        fprintf(stderr, "Unable to deduplicate the frames of %s\n", outDir);
+        closeCapture(&in);
+        return 1;
+    }
+    u64 packed = 0;
+    if(maskRuns && to == FORMAT_1BCM) {
+        snprintf(path, sizeof(path), "%s/%s", outDir, getDataName(to));
+        if(!(packed = packMasks(out, path))) {
+            fprintf(stderr, "Unable to pack the masks of %s\n", path);
+            closeCapture(&in);
+            return 1;
+        }
+    }
+    if(shardBytes && splitShards(out, outDir, shardBytes)) {
+        fprintf(stderr, "Unable to split %s in shards\n", outDir);
+        closeCapture(&in);
+        return 1;
+    }
+    if(job.occupancy >= 0) {
+        close(job.occupancy);
+    }
+    while(--job.lodCount) {
+        close(job.lods[job.lodCount]);
+    }
+    const double elapsed = getSeconds() - start;
+
+    const u64 inBytes = frames * in.FRAME_BYTES_COUNT;
+    const u64 outBytes = packed ? packed : (u64)stored * out->FRAME_BYTES_COUNT + out->HEADER_SIZE;
+    printf("%s -> %s: %llu frames in %.3f s, %.1f fps, %ld threads\n",
+        FORMAT_NAMES[from], FORMAT_NAMES[to], (unsigned long long)frames,
+        elapsed, frames / elapsed, threads);
+    printf("Size: %llu -> %llu bytes (%.2fx)\n", (unsigned long long)inBytes,
+        (unsigned long long)outBytes, (double)inBytes / outBytes);
+
+    closeCapture(&in);
+    return 0;
+}
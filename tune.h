@@ -0,0 +1,117 @@
+/*
+ * APoV Project
+ * Startup calibration of the copy and compose kernels
+ */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#define TUNE_FILE "tune.txt"
+#define TUNE_RUNS_COUNT 3
+#define TUNE_BYTES_COUNT 256
+
+// Each operation has a few candidate kernels, timed once on the real buffers
+// and the fastest kept in tune.txt as one "NAME:kernel" line followed by the
+// timings in us. Later launches read the choice back, TUNE:1 times them again.
+static u8 TUNE = 0;
+
+typedef void (*Kernel)(void* const arg);
+
+typedef struct Candidate {
+    u8 id;
+    const char* name;
+    Kernel kernel;
+} Candidate;
+
+static char tuned[TUNE_BYTES_COUNT];
+static char tuneLines[TUNE_BYTES_COUNT];
+static u32 tuneLength = 0;
+static u8 tuneRead = 0;
+static u8 tuneChanged = 0;
+
+static void readTuned() {
+    if(tuneRead) {
+        return;
+    }
+    tuneRead = 1;
+    tuned[0] = 0;
+    const SceUID fd = TUNE ? -1 : sceIoOpen(TUNE_FILE, PSP_O_RDONLY, 0777);
+    if(fd >= 0) {
+        const int n = sceIoRead(fd, tuned, TUNE_BYTES_COUNT - 1);
+        tuned[n > 0 ? n : 0] = 0;
+        sceIoClose(fd);
+    }
+}
+
+// Returns the index of the stored candidate, count when unknown
+static u8 getTuned(const char* const name, const Candidate* const candidates, const u8 count) {
+    char key[16];
+    snprintf(key, sizeof(key), "%s:", name);
+    const char* const line = strstr(tuned, key);
+    u8 i = 0;
+    while(line != NULL && i < count) {
+        const char* const kernel = line + strlen(key);
+        const u32 n = strlen(candidates[i].name);
+        if(!strncmp(kernel, candidates[i].name, n) && (kernel[n] == ' ' || kernel[n] == '\n' || !kernel[n])) {
+            return i;
+        }
+        i++;
+    }
+    return count;
+}
+
+// Picks the kernel of an operation, timing the candidates when the profile
+// does not hold a valid choice. Returns the id of the kernel.
+static u8 pickKernel(const char* const name, const Candidate* const candidates, const u8 count, void* const arg) {
+    readTuned();
+    u8 best = getTuned(name, candidates, count);
+    const u8 timed = best == count && count > 1;
+    u32 times[count];
+    if(best == count) {
+        best = 0;
+        tuneChanged = 1;
+    }
+    if(timed) {
+        u8 i = 0;
+        while(i < count) {
+            times[i] = 0xFFFFFFFF;
+            u8 run = TUNE_RUNS_COUNT;
+            while(run--) {
+                const u32 start = sceKernelGetSystemTimeLow();
+                candidates[i].kernel(arg);
+                const u32 elapsed = sceKernelGetSystemTimeLow() - start;
+                times[i] = elapsed < times[i] ? elapsed : times[i];
+            }
+            best = times[i] < times[best] ? i : best;
+            i++;
+        }
+    }
+
+    tuneLength += snprintf(&tuneLines[tuneLength], TUNE_BYTES_COUNT - tuneLength, "%s:%s",
+        name, candidates[best].name);
+    u8 i = 0;
+    while(timed && i < count && tuneLength < TUNE_BYTES_COUNT) {
+        tuneLength += snprintf(&tuneLines[tuneLength], TUNE_BYTES_COUNT - tuneLength, " %s %u",
+            candidates[i].name, times[i]);
+        i++;
+    }
+    if(tuneLength < TUNE_BYTES_COUNT) {
+        tuneLength += snprintf(&tuneLines[tuneLength], TUNE_BYTES_COUNT - tuneLength, "\n");
+    }
+    tuneLength = tuneLength < TUNE_BYTES_COUNT ? tuneLength : TUNE_BYTES_COUNT - 1;
+    return candidates[best].id;
+}
+
+// Saves the choices once one of them was timed again
+static void writeTuned() {
+    if(!tuneChanged) {
+        return;
+    }
+    const SceUID fd = sceIoOpen(TUNE_FILE, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(fd >= 0) {
+        sceIoWrite(fd, tuneLines, tuneLength);
+        sceIoClose(fd);
+    }
+}
+
+#endif